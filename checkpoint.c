@@ -0,0 +1,268 @@
+#include <pthread.h>
+#include <zlib.h>
+
+#include "kernel.h"
+
+/* Checkpoint file layout:
+ *   struct CheckpointHeader
+ *   the state of every frame (FRAME_FREE, FRAME_ZERO or FRAME_DATA), one char each
+ *   for every process slot: char running, int size, then if running, int PFN and char flags of every PTE
+ *     (1 present, 2 zero)
+ *     and int rt_pool_num (-1 if not real-time) followed by the reserved frames,
+ *     and char 1 if the heap span record (int per page) follows, 0 if the process has none
+ *   the compressed chunks, chunk c holds the FRAME_DATA frames of [c, c + 1) * CHECKPOINT_CHUNK_FRAMES in order
+ *   struct ChunkIndex of every chunk (at header.index_offset) */
+#define CHECKPOINT_MAGIC "KPUCKPT2"
+#define FRAME_FREE 0
+#define FRAME_ZERO 1
+#define FRAME_DATA 2
+
+struct CheckpointHeader {
+    char magic[8];
+    int kernel_space_size, virtual_space_size, page_size, max_process_num;
+    int allocated_pages;
+    int num_chunks;
+    long long index_offset;
+};
+
+struct ChunkIndex {
+    long long offset;
+    int compressed_len;    // 0 if the chunk has no FRAME_DATA frame.
+    int data_frames;
+};
+
+struct ChunkJobs {
+    struct Kernel* kernel;
+    char* states;
+    int num_chunks;
+    int next;              // The next chunk to be taken by a thread.
+    char** compressed;     // Checkpoint: the compressed chunks. Restore: the chunks read from the file.
+    struct ChunkIndex* index;
+    int failed;            // Set by any of the threads, read once they are joined.
+};
+
+static void* compress_chunks(void* arg) {
+    struct ChunkJobs* jobs = arg;
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    char* raw = malloc((long long) CHECKPOINT_CHUNK_FRAMES * PAGE_SIZE);
+
+    for (int c; (c = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->num_chunks; ) {
+        int n = 0;
+        for (int j = c * CHECKPOINT_CHUNK_FRAMES; j < min(frames, (c + 1) * CHECKPOINT_CHUNK_FRAMES); ++j)
+            if (jobs->states[j] == FRAME_DATA)
+                memcpy(raw + (long long) PAGE_SIZE * n++, frame_ptr(jobs->kernel, j, 0), PAGE_SIZE);
+        jobs->index[c].data_frames = n;
+        jobs->index[c].compressed_len = 0;
+        if (n == 0) continue;
+
+        uLongf len = compressBound((uLong) n * PAGE_SIZE);
+        jobs->compressed[c] = malloc(len);
+        if (compress2((Bytef*) jobs->compressed[c], &len, (Bytef*) raw, (uLong) n * PAGE_SIZE, Z_BEST_SPEED) != Z_OK)
+            __atomic_store_n(&jobs->failed, 1, __ATOMIC_RELAXED);
+        jobs->index[c].compressed_len = len;
+    }
+    free(raw);
+    return NULL;
+}
+
+static void* decompress_chunks(void* arg) {
+    struct ChunkJobs* jobs = arg;
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    char* raw = malloc((long long) CHECKPOINT_CHUNK_FRAMES * PAGE_SIZE);
+
+    for (int c; (c = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->num_chunks; ) {
+        if (jobs->index[c].data_frames == 0) continue;
+
+        uLongf len = (uLongf) jobs->index[c].data_frames * PAGE_SIZE;
+        if (uncompress((Bytef*) raw, &len, (Bytef*) jobs->compressed[c], jobs->index[c].compressed_len) != Z_OK
+            || len != (uLongf) jobs->index[c].data_frames * PAGE_SIZE) {
+            __atomic_store_n(&jobs->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        int n = 0;
+        for (int j = c * CHECKPOINT_CHUNK_FRAMES; j < min(frames, (c + 1) * CHECKPOINT_CHUNK_FRAMES); ++j)
+            if (jobs->states[j] == FRAME_DATA && n < jobs->index[c].data_frames)
+                memcpy(jobs->kernel->space + (long long) PAGE_SIZE * j, raw + (long long) PAGE_SIZE * n++, PAGE_SIZE);
+        if (n != jobs->index[c].data_frames) __atomic_store_n(&jobs->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(raw);
+    return NULL;
+}
+
+// Run fn over all the chunks with CHECKPOINT_THREADS threads (the calling one included).
+static void run_chunk_jobs(struct ChunkJobs* jobs, void* (*fn)(void*)) {
+    int no_of_threads = CHECKPOINT_THREADS > 1 ? min(CHECKPOINT_THREADS, jobs->num_chunks) : 1;
+    pthread_t* threads = malloc(sizeof(pthread_t) * no_of_threads);
+    char* spawned = calloc(no_of_threads, sizeof(char));
+    for (int t = 1; t < no_of_threads; ++t)
+        spawned[t] = pthread_create(&threads[t], NULL, fn, jobs) == 0;
+    fn(jobs);
+    for (int t = 1; t < no_of_threads; ++t)
+        if (spawned[t]) pthread_join(threads[t], NULL);
+    free(spawned);
+    free(threads);
+}
+
+/* This function will checkpoint a kernel to the file at path,
+ * returns 0 when succeeded, -1 when failed. */
+int kernel_checkpoint(struct Kernel* kernel, const char* path) {
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    // A frame buffer lent out belongs to nobody in the checkpoint
+    if (kernel->lent_num > 0) return -1;
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid) {
+        if (!kernel->running[pid]) continue;
+        if (kernel->mm[pid].hibernate_fd != -1) return -1;
+        for (int i = 0; i < (kernel->mm[pid].size - 1) / PAGE_SIZE + 1; ++i)
+            if (kernel->mm[pid].page_table->ptes[i].swapped || kernel->mm[pid].page_table->ptes[i].foreign) return -1;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return -1;
+
+    struct ChunkJobs jobs = {kernel, malloc(frames), (frames - 1) / CHECKPOINT_CHUNK_FRAMES + 1, 0, NULL, NULL, 0};
+    jobs.compressed = calloc(jobs.num_chunks, sizeof(char*));
+    jobs.index = calloc(jobs.num_chunks, sizeof(struct ChunkIndex));
+    for (int j = 0; j < frames; ++j)
+        if (!kernel->occupied_pages[j]) jobs.states[j] = FRAME_FREE;
+        else jobs.states[j] = is_zero(frame_ptr(kernel, j, 0), PAGE_SIZE) ? FRAME_ZERO : FRAME_DATA;
+    run_chunk_jobs(&jobs, compress_chunks);
+
+    struct CheckpointHeader header = {CHECKPOINT_MAGIC, KERNEL_SPACE_SIZE, VIRTUAL_SPACE_SIZE, PAGE_SIZE, MAX_PROCESS_NUM,
+                                      kernel->allocated_pages, jobs.num_chunks, 0};
+    int failed = jobs.failed || fwrite(&header, sizeof(header), 1, file) != 1;
+    failed = failed || fwrite(jobs.states, 1, frames, file) != (size_t) frames;
+    for (int pid = 0; pid < MAX_PROCESS_NUM && !failed; ++pid) {
+        failed = fwrite(&kernel->running[pid], 1, 1, file) != 1 || fwrite(&kernel->mm[pid].size, sizeof(int), 1, file) != 1;
+        if (!kernel->running[pid]) continue;
+        for (int i = 0; i < (kernel->mm[pid].size - 1) / PAGE_SIZE + 1 && !failed; ++i) {
+            struct PTE* pte = &kernel->mm[pid].page_table->ptes[i];
+            char flags = pte->present | pte->zero << 1;
+            failed = fwrite(&pte->PFN, sizeof(int), 1, file) != 1 || fwrite(&flags, 1, 1, file) != 1;
+        }
+        int rt_pool_num = kernel->mm[pid].rt_pool != NULL ? kernel->mm[pid].rt_pool_num : -1;
+        failed = failed || fwrite(&rt_pool_num, sizeof(int), 1, file) != 1;
+        if (rt_pool_num > 0)
+            failed = failed || fwrite(kernel->mm[pid].rt_pool, sizeof(int), rt_pool_num, file) != (size_t) rt_pool_num;
+        char heap = kernel->mm[pid].heap_spans != NULL;
+        size_t no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+        failed = failed || fwrite(&heap, 1, 1, file) != 1;
+        if (heap) failed = failed || fwrite(kernel->mm[pid].heap_spans, sizeof(int), no_of_pages, file) != no_of_pages;
+    }
+    for (int c = 0; c < jobs.num_chunks && !failed; ++c) {
+        jobs.index[c].offset = ftello(file);
+        failed = fwrite(jobs.compressed[c], 1, jobs.index[c].compressed_len, file) != (size_t) jobs.index[c].compressed_len;
+    }
+    header.index_offset = ftello(file);
+    failed = failed || fwrite(jobs.index, sizeof(struct ChunkIndex), jobs.num_chunks, file) != (size_t) jobs.num_chunks;
+    failed = failed || fseeko(file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file) != 1;
+    failed = fclose(file) || failed;
+
+    for (int c = 0; c < jobs.num_chunks; ++c) free(jobs.compressed[c]);
+    free(jobs.compressed);
+    free(jobs.index);
+    free(jobs.states);
+    return failed ? -1 : 0;
+}
+
+/* This function will restore a kernel from a checkpoint file,
+ * returns the kernel when succeeded, NULL when failed. */
+struct Kernel* kernel_restore(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    struct CheckpointHeader header;
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, 8)
+        || header.kernel_space_size != KERNEL_SPACE_SIZE || header.virtual_space_size != VIRTUAL_SPACE_SIZE
+        || header.page_size != PAGE_SIZE || header.max_process_num != MAX_PROCESS_NUM
+        || header.num_chunks != (frames - 1) / CHECKPOINT_CHUNK_FRAMES + 1) {
+        fclose(file);
+        return NULL;
+    }
+
+    struct Kernel* kernel = init_kernel();
+    struct ChunkJobs jobs = {kernel, malloc(frames), header.num_chunks, 0, NULL, NULL, 0};
+    jobs.compressed = calloc(jobs.num_chunks, sizeof(char*));
+    jobs.index = calloc(jobs.num_chunks, sizeof(struct ChunkIndex));
+
+    int failed = fread(jobs.states, 1, frames, file) != (size_t) frames;
+    for (int j = 0; j < frames && !failed; ++j)
+        kernel->occupied_pages[j] = jobs.states[j] != FRAME_FREE;
+    for (int j = 0; j < frames && !failed; ++j) kernel->free_frames -= kernel->occupied_pages[j];
+    kernel->allocated_pages = header.allocated_pages;
+
+    for (int pid = 0; pid < MAX_PROCESS_NUM && !failed; ++pid) {
+        int size;
+        failed = fread(&kernel->running[pid], 1, 1, file) != 1 || fread(&size, sizeof(int), 1, file) != 1;
+        if (failed || !kernel->running[pid]) continue;
+        if (size <= 0 || size > VIRTUAL_SPACE_SIZE) {
+            kernel->running[pid] = 0;
+            failed = 1;
+            break;
+        }
+
+        int no_of_pages = (size - 1) / PAGE_SIZE + 1;
+        kernel->mm[pid].size = size;
+        kernel->mm[pid].generation = 1;
+        kernel->mm[pid].page_table = malloc(sizeof(struct PageTable));
+        kernel->mm[pid].page_table->ptes = calloc(no_of_pages, sizeof(struct PTE));
+        kernel->mm[pid].page_table->refs = 1;
+        for (int i = 0; i < no_of_pages && !failed; ++i) {
+            struct PTE* pte = &kernel->mm[pid].page_table->ptes[i];
+            char flags;
+            failed = fread(&pte->PFN, sizeof(int), 1, file) != 1 || fread(&flags, 1, 1, file) != 1;
+            pte->present = flags & 1;
+            pte->zero = !pte->present && (flags & 2);
+            if (!failed && pte->present) failed = 0 > pte->PFN || pte->PFN >= frames || jobs.states[pte->PFN] == FRAME_FREE;
+            if (failed) pte->present = 0;
+        }
+
+        int rt_pool_num;
+        failed = failed || fread(&rt_pool_num, sizeof(int), 1, file) != 1 || rt_pool_num > no_of_pages;
+        if (!failed && rt_pool_num >= 0) {
+            kernel->mm[pid].rt_pool = malloc(sizeof(int) * no_of_pages);
+            failed = fread(kernel->mm[pid].rt_pool, sizeof(int), rt_pool_num, file) != (size_t) rt_pool_num;
+            for (int i = 0; i < rt_pool_num && !failed; ++i) {
+                int pfn = kernel->mm[pid].rt_pool[i];
+                failed = 0 > pfn || pfn >= frames || jobs.states[pfn] == FRAME_FREE;
+                if (!failed) kernel->mm[pid].rt_pool_num = i + 1;
+            }
+        }
+
+        char heap;
+        failed = failed || fread(&heap, 1, 1, file) != 1;
+        if (failed || !heap) continue;
+        kernel->mm[pid].heap_spans = malloc(sizeof(int) * no_of_pages);
+        failed = fread(kernel->mm[pid].heap_spans, sizeof(int), no_of_pages, file) != (size_t) no_of_pages;
+    }
+
+    // Read every chunk through the index, then decompress them in parallel
+    failed = failed || fseeko(file, header.index_offset, SEEK_SET);
+    failed = failed || fread(jobs.index, sizeof(struct ChunkIndex), jobs.num_chunks, file) != (size_t) jobs.num_chunks;
+    for (int c = 0; c < jobs.num_chunks && !failed; ++c) {
+        if (jobs.index[c].data_frames == 0) continue;
+        if (jobs.index[c].data_frames > CHECKPOINT_CHUNK_FRAMES || jobs.index[c].compressed_len <= 0) {
+            failed = 1;
+            break;
+        }
+        jobs.compressed[c] = malloc(jobs.index[c].compressed_len);
+        failed = fseeko(file, jobs.index[c].offset, SEEK_SET)
+                 || fread(jobs.compressed[c], 1, jobs.index[c].compressed_len, file) != (size_t) jobs.index[c].compressed_len;
+    }
+    if (!failed) {
+        run_chunk_jobs(&jobs, decompress_chunks);
+        failed = jobs.failed;
+    }
+    fclose(file);
+
+    for (int c = 0; c < jobs.num_chunks; ++c) free(jobs.compressed[c]);
+    free(jobs.compressed);
+    free(jobs.index);
+    free(jobs.states);
+    if (failed) {
+        destroy_kernel(kernel);
+        return NULL;
+    }
+    return kernel;
+}
@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pagingd.h"
+
+struct PagingdClient {
+    int fd;
+    char* ring;
+    int* sizes;      // The size of every pid of the client, 0 when not its own, to check bounds up front.
+    int sizes_num;
+};
+
+static int recv_all(int fd, void* buf, int size) {
+    for (int done = 0; done < size;) {
+        ssize_t n = recv(fd, (char*) buf + done, size - done, 0);
+        if (n == 0 || (n == -1 && errno != EINTR)) return -1;
+        if (n > 0) done += n;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void* buf, int size) {
+    for (int done = 0; done < size;) {
+        ssize_t n = send(fd, (const char*) buf + done, size - done, MSG_NOSIGNAL);
+        if (n == -1 && errno != EINTR) return -1;
+        if (n > 0) done += n;
+    }
+    return 0;
+}
+
+/* This function will receive the ring fd passed by the daemon, returns it when succeeded, -1 when failed. */
+static int recv_ring(int fd) {
+    char data;
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    int ring_fd;
+    memcpy(&ring_fd, CMSG_DATA(cmsg), sizeof(int));
+    return ring_fd;
+}
+
+struct PagingdClient* pagingd_connect(const char* path) {
+    if (path == NULL) path = PAGINGD_SOCKET;
+    struct sockaddr_un sun = {0};
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) return NULL;
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return NULL;
+    if (connect(fd, (struct sockaddr*) &sun, sizeof(sun)) == -1) {
+        close(fd);
+        return NULL;
+    }
+    int ring_fd = recv_ring(fd);
+    if (ring_fd == -1) {
+        close(fd);
+        return NULL;
+    }
+    char* ring = mmap(NULL, PAGINGD_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    close(ring_fd);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    struct PagingdClient* client = calloc(1, sizeof(struct PagingdClient));
+    client->fd = fd;
+    client->ring = ring;
+    return client;
+}
+
+void pagingd_disconnect(struct PagingdClient* client) {
+    if (client == NULL) return;
+    // The daemon exits the processes left once it sees the connection closed
+    munmap(client->ring, PAGINGD_RING_SIZE);
+    close(client->fd);
+    free(client->sizes);
+    free(client);
+}
+
+/* This function will send one request and wait for its reply, returns the reply, -1 when the daemon is gone. */
+static int call(struct PagingdClient* client, struct PagingdRequest* req) {
+    struct PagingdReply reply;
+    if (send_all(client->fd, req, sizeof(*req)) == -1) return -1;
+    if (recv_all(client->fd, &reply, sizeof(reply)) == -1) return -1;
+    return reply.ret;
+}
+
+int pagingd_proc_create_vm(struct PagingdClient* client, int size) {
+    struct PagingdRequest req = {PAGINGD_CREATE, -1, size, 0, 0};
+    int pid = call(client, &req);
+    if (pid < 0) return -1;
+
+    if (pid >= client->sizes_num) {
+        int num = pid + 1 > client->sizes_num * 2 ? pid + 1 : client->sizes_num * 2;
+        client->sizes = realloc(client->sizes, sizeof(int) * num);
+        memset(client->sizes + client->sizes_num, 0, sizeof(int) * (num - client->sizes_num));
+        client->sizes_num = num;
+    }
+    client->sizes[pid] = size;
+    return pid;
+}
+
+int pagingd_proc_exit_vm(struct PagingdClient* client, int pid) {
+    struct PagingdRequest req = {PAGINGD_EXIT, pid, 0, 0, 0};
+    int ret = call(client, &req);
+    if (ret == 0 && pid < client->sizes_num) client->sizes[pid] = 0;
+    return ret;
+}
+
+/* This function will run a read or write as slot-sized requests, up to PAGINGD_SLOTS of them in flight,
+ * returns 0 when succeeded, -1 when failed. */
+static int transfer(struct PagingdClient* client, int op, int pid, char* addr, int size, char* buf) {
+    // The same bounds check as the kernel's, so that a bad access is refused as a whole
+    if (0 > pid || pid >= client->sizes_num || client->sizes[pid] == 0 || size <= 0) return -1;
+    long start = (long) addr;
+    if (start < 0 || start + size > client->sizes[pid]) return -1;
+
+    int chunks = (size + PAGINGD_SLOT_SIZE - 1) / PAGINGD_SLOT_SIZE, sent = 0, done = 0, ret = 0;
+    while (done < chunks) {
+        // Keep the ring full, the daemon copies a slot while the next one is filled
+        while (sent < chunks && sent - done < PAGINGD_SLOTS) {
+            int offset = sent * PAGINGD_SLOT_SIZE, len = size - offset < PAGINGD_SLOT_SIZE ? size - offset : PAGINGD_SLOT_SIZE;
+            struct PagingdRequest req = {op, pid, (int) (start + offset), len, sent % PAGINGD_SLOTS};
+            if (op == PAGINGD_WRITE) memcpy(client->ring + (long) req.slot * PAGINGD_SLOT_SIZE, buf + offset, len);
+            if (send_all(client->fd, &req, sizeof(req)) == -1) return -1;
+            ++sent;
+        }
+
+        // Replies come back in order, the oldest one frees its slot
+        struct PagingdReply reply;
+        if (recv_all(client->fd, &reply, sizeof(reply)) == -1) return -1;
+        if (reply.ret != 0) ret = -1;
+        else if (op == PAGINGD_READ) {
+            int offset = done * PAGINGD_SLOT_SIZE, len = size - offset < PAGINGD_SLOT_SIZE ? size - offset : PAGINGD_SLOT_SIZE;
+            memcpy(buf + offset, client->ring + (long) (done % PAGINGD_SLOTS) * PAGINGD_SLOT_SIZE, len);
+        }
+        ++done;
+    }
+    return ret;
+}
+
+int pagingd_vm_read(struct PagingdClient* client, int pid, char* addr, int size, char* buf) {
+    return transfer(client, PAGINGD_READ, pid, addr, size, buf);
+}
+
+int pagingd_vm_write(struct PagingdClient* client, int pid, char* addr, int size, char* buf) {
+    return transfer(client, PAGINGD_WRITE, pid, addr, size, buf);
+}
@@ -0,0 +1,51 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "kernel.h"
+
+// Whole-page copies for the pages in the middle of a transfer, where the size is known to be PAGE_SIZE:
+// a fixed size lets the copy be a handful of vector moves instead of a call into memcpy.
+
+static void copy_page_any(char* dst, const char* src) {
+    memcpy(dst, src, PAGE_SIZE);
+}
+
+static void copy_page_32(char* dst, const char* src) {
+    memcpy(dst, src, 32);
+}
+
+static void copy_page_64(char* dst, const char* src) {
+    memcpy(dst, src, 64);
+}
+
+// Big pages are best left to the libc memcpy (rep movsb or its own vector loop), with the size known up front.
+static void copy_page_4096(char* dst, const char* src) {
+    memcpy(dst, src, 4096);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void copy_page_32_avx2(char* dst, const char* src) {
+    _mm256_storeu_si256((__m256i*) dst, _mm256_loadu_si256((const __m256i*) src));
+}
+
+__attribute__((target("avx2"))) static void copy_page_64_avx2(char* dst, const char* src) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) src), b = _mm256_loadu_si256((const __m256i*) (src + 32));
+    _mm256_storeu_si256((__m256i*) dst, a);
+    _mm256_storeu_si256((__m256i*) (dst + 32), b);
+}
+#endif
+
+/* This function will pick the page copy for the current PAGE_SIZE and CPU, returns it. */
+CopyPageFn select_copy_page() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        if (PAGE_SIZE == 32) return copy_page_32_avx2;
+        if (PAGE_SIZE == 64) return copy_page_64_avx2;
+    }
+#endif
+    if (PAGE_SIZE == 32) return copy_page_32;
+    if (PAGE_SIZE == 64) return copy_page_64;
+    if (PAGE_SIZE == 4096) return copy_page_4096;
+    return copy_page_any;
+}
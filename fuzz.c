@@ -0,0 +1,443 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel.h"
+#include "ref_kernel.h"
+
+/* Differential fuzzer: replays one random operation sequence against the reference model (ref_kernel.c) and against
+ * the kernel in every configuration of CONFIGS, and aborts on the first difference.
+ *
+ * Every configuration must give the same return codes and the same bytes back for whatever was written.
+ * Those which leave frame placement alone must also give the same mappings and free space info,
+ * and those which leave frame content alone the same bytes back for what was never written (stale frame content).
+ * Whatever the configuration, the kernel must stay consistent: no frame mapped twice, free_frames right.
+ *
+ * Input: the first byte picks PAGE_SIZE, then each operation is an opcode byte followed by its arguments
+ * (missing bytes read as 0). Processes always get their pages reserved at creation, so faults never run out:
+ * the reference model has FRAMES frames, a configuration with swap takes its slots out of the kernel's frames,
+ * so that its faults evict pages once the processes reserve more than the frames left.
+ *
+ * libFuzzer:  make libfuzzer (clang -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER)
+ * Standalone: ./fuzz [-n runs] [-s seed] [-l max input length] [input file...]
+ *             replays the input files (e.g. a crash from libFuzzer), or runs random inputs without any. */
+
+#define SAME_DATA 0       // Return codes and the bytes written.
+#define SAME_FRAMES 1     // Plus mappings and free space info.
+#define SAME_ALL 2        // Plus the stale content of frames never written by their process.
+
+struct Config {
+    const char* name;
+    int same;
+    int parallel_copy_threshold, parallel_copy_threads;
+    int alloc_policy, fault_around_pages, hot_frames, prefetch_pages, zero_page_detection, free_page_reporting_batch;
+    int swap_slots, replacement_policy;     // Swap slots taken out of FRAMES, so that faults evict pages.
+};
+
+static struct Config CONFIGS[] = {
+    {"default", SAME_ALL, 0, 1, ALLOC_FIRST_FIT, 0, 0, 0, 0, 0, 0, REPLACE_CLOCK},
+    {"parallel copy", SAME_ALL, 64, 4, ALLOC_FIRST_FIT, 0, 0, 0, 0, 0, 0, REPLACE_CLOCK},
+    {"free page reporting", SAME_FRAMES, 0, 1, ALLOC_FIRST_FIT, 0, 0, 0, 0, 2, 0, REPLACE_CLOCK},
+    {"next fit", SAME_DATA, 0, 1, ALLOC_NEXT_FIT, 0, 0, 0, 0, 0, 0, REPLACE_CLOCK},
+    {"fault around", SAME_DATA, 0, 1, ALLOC_FIRST_FIT, 4, 0, 0, 0, 0, 0, REPLACE_CLOCK},
+    {"hot frames", SAME_DATA, 0, 1, ALLOC_FIRST_FIT, 0, 8, 0, 0, 0, 0, REPLACE_CLOCK},
+    {"zero pages", SAME_DATA, 0, 1, ALLOC_FIRST_FIT, 0, 0, 0, 1, 0, 0, REPLACE_CLOCK},
+    {"swap clock", SAME_DATA, 0, 1, ALLOC_FIRST_FIT, 0, 0, 4, 0, 0, 24, REPLACE_CLOCK},
+    {"swap fifo", SAME_DATA, 0, 1, ALLOC_FIRST_FIT, 0, 0, 0, 0, 0, 24, REPLACE_FIFO},
+    {"all", SAME_DATA, 64, 4, ALLOC_NEXT_FIT, 4, 8, 4, 1, 2, 24, REPLACE_CLOCK},
+};
+
+static int PAGE_SIZES[] = {16, 32, 64, 4096};
+
+#define PAGES_PER_PROCESS 16
+#define FRAMES 40
+#define PROCESSES 4
+#define MAX_BATCH 8
+#define MAX_LENT 4
+
+struct Input {
+    const uint8_t* data;
+    size_t size, pos;
+};
+
+static int next_byte(struct Input* in) {
+    return in->pos < in->size ? in->data[in->pos++] : 0;
+}
+
+static int next_u16(struct Input* in) {
+    int lo = next_byte(in);
+    return lo | next_byte(in) << 8;
+}
+
+// The state of one run: both kernels, and which bytes of every process have been written.
+struct Run {
+    struct Config* config;
+    struct Kernel* kernel;
+    struct RefKernel* ref;
+    char* written[PROCESSES];
+    char* lent[MAX_LENT];     // Frame buffers lent out, and the PFN of each in the reference model.
+    int ref_lent[MAX_LENT];
+    int lent_num;
+    struct ProcHandle* handles[PROCESSES];  // Kept across exits, a handle whose process exited (stale) must fail.
+    char stale[PROCESSES];
+    int op;
+};
+
+static const uint8_t* current_data;
+static size_t current_size;
+
+static void fail(struct Run* run, const char* what) {
+    fprintf(stderr, "fuzz: PAGE_SIZE %d, config \"%s\", operation %d: %s\n", PAGE_SIZE, run->config->name, run->op, what);
+#ifndef FUZZ_LIBFUZZER
+    // libFuzzer saves the input by itself
+    FILE* file = fopen("crash-fuzz", "wb");
+    if (file != NULL) {
+        fwrite(current_data, 1, current_size, file);
+        fclose(file);
+        fprintf(stderr, "fuzz: input saved to crash-fuzz\n");
+    }
+#endif
+    abort();
+}
+
+/* This function will check the kernel against itself: every frame mapped once at most, all of them occupied. */
+static void check_consistency(struct Run* run) {
+    struct Kernel* kernel = run->kernel;
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE, occupied = 0;
+    char* mapped = calloc(frames, 1);
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid) {
+        if (kernel->running[pid] != run->ref->running[pid]) fail(run, "running processes differ");
+        if (!kernel->running[pid]) continue;
+        for (int i = 0; i < (kernel->mm[pid].size - 1) / PAGE_SIZE + 1; ++i) {
+            struct PTE* pte = &kernel->mm[pid].page_table->ptes[i];
+            if (!pte->present) continue;
+            if (0 > pte->PFN || pte->PFN >= frames) fail(run, "PFN out of range");
+            if (mapped[pte->PFN]++) fail(run, "frame mapped twice");
+            if (!kernel->occupied_pages[pte->PFN]) fail(run, "mapped frame is free");
+        }
+    }
+    for (int i = 0; i < frames; ++i) occupied += kernel->occupied_pages[i];
+    if (kernel->free_frames != frames - occupied) fail(run, "free_frames is off");
+    free(mapped);
+}
+
+/* This function will compare the mappings and free space info of both kernels. */
+static void check_frames(struct Run* run) {
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid) {
+        if (!run->ref->running[pid]) continue;
+        for (int i = 0; i < (run->ref->mm[pid].size - 1) / PAGE_SIZE + 1; ++i) {
+            struct PTE* pte = &run->kernel->mm[pid].page_table->ptes[i];
+            struct RefPTE* ref = &run->ref->mm[pid].ptes[i];
+            if (pte->present != ref->present || (ref->present && pte->PFN != ref->PFN)) fail(run, "mappings differ");
+        }
+    }
+
+    int len = 64 * (KERNEL_SPACE_SIZE / PAGE_SIZE + 1);
+    char* buf = malloc(len), * ref_buf = malloc(len);
+    get_kernel_free_space_info(run->kernel, buf);
+    ref_get_kernel_free_space_info(run->ref, ref_buf);
+    if (strcmp(buf, ref_buf) != 0) fail(run, "free space info differs");
+    free(buf);
+    free(ref_buf);
+}
+
+/* This function will compare what both kernels read from [addr, addr + size) of a process,
+ * the bytes never written only if the configuration keeps frame content. */
+static void check_read(struct Run* run, int pid, int addr, int size, char* buf, char* ref_buf) {
+    for (int i = 0; i < size; ++i)
+        if (buf[i] != ref_buf[i] && (run->config->same == SAME_ALL || run->written[pid][addr + i])) fail(run, "read results differ");
+}
+
+static void check_ret(struct Run* run, int ret, int ref_ret) {
+    if (ret != ref_ret) fail(run, "return codes differ");
+}
+
+static void mark_written(struct Run* run, int pid, int addr, int size) {
+    memset(run->written[pid] + addr, 1, size);
+}
+
+/* This function will fill buf with the pattern picked by seed: runs of zeros (whole zero pages) or bytes. */
+static void fill(char* buf, int size, int seed) {
+    if (seed % 4 == 0) memset(buf, 0, size);
+    else for (int i = 0; i < size; ++i) buf[i] = (char) (seed + i * 31);
+}
+
+/* This function will pick an address in (or, now and then, just out of) a process. */
+static int pick_addr(struct Run* run, struct Input* in, int pid) {
+    int size = pid < MAX_PROCESS_NUM && run->ref->running[pid] ? run->ref->mm[pid].size : VIRTUAL_SPACE_SIZE;
+    int addr = next_u16(in) % (size + PAGE_SIZE);
+    // Page aligned accesses are what zero page detection and whole-page copies look at
+    return addr & 1 ? addr / PAGE_SIZE * PAGE_SIZE : addr;
+}
+
+static int pick_size(struct Input* in) {
+    int size = next_u16(in) % (4 * PAGE_SIZE) + 1;
+    return size & 1 ? (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE : size;
+}
+
+static void op_create(struct Run* run, struct Input* in) {
+    int size = next_u16(in) % (VIRTUAL_SPACE_SIZE + PAGE_SIZE) + 1;
+    int pid = proc_create_vm(run->kernel, size), ref_pid = ref_proc_create_vm(run->ref, size);
+    check_ret(run, pid, ref_pid);
+    if (pid != -1) run->written[pid] = calloc(size, 1);
+}
+
+static void op_exit(struct Run* run, struct Input* in) {
+    int pid = next_byte(in) % (MAX_PROCESS_NUM + 1);
+    int ret = proc_exit_vm(run->kernel, pid), ref_ret = ref_proc_exit_vm(run->ref, pid);
+    check_ret(run, ret, ref_ret);
+    if (ret == 0) {
+        free(run->written[pid]);
+        run->written[pid] = NULL;
+        run->stale[pid] = 1;
+    }
+}
+
+static void op_access(struct Run* run, struct Input* in, int write) {
+    int pid = next_byte(in) % (MAX_PROCESS_NUM + 1);
+    int addr = pick_addr(run, in, pid), size = pick_size(in), seed = next_byte(in);
+    char* buf = malloc(size), * ref_buf = malloc(size);
+    fill(buf, size, seed);
+    memcpy(ref_buf, buf, size);
+    if (write) {
+        int ret = vm_write(run->kernel, pid, (char*) (long) addr, size, buf);
+        check_ret(run, ret, ref_vm_write(run->ref, pid, (char*) (long) addr, size, ref_buf));
+        if (ret == 0) mark_written(run, pid, addr, size);
+    }
+    else {
+        int ret = vm_read(run->kernel, pid, (char*) (long) addr, size, buf);
+        check_ret(run, ret, ref_vm_read(run->ref, pid, (char*) (long) addr, size, ref_buf));
+        if (ret == 0) check_read(run, pid, addr, size, buf, ref_buf);
+    }
+    free(buf);
+    free(ref_buf);
+}
+
+/* Handle accesses are checked against plain ones, through a handle opened on an earlier operation when there is one. */
+static void op_handle(struct Run* run, struct Input* in, int write) {
+    int pid = next_byte(in) % MAX_PROCESS_NUM;
+    if (run->handles[pid] == NULL || next_byte(in) % 4 == 0) {
+        if (run->handles[pid] != NULL) proc_close(run->handles[pid]);
+        run->handles[pid] = proc_open(run->kernel, pid);
+        run->stale[pid] = 0;
+        check_ret(run, run->handles[pid] == NULL ? -1 : 0, run->ref->running[pid] ? 0 : -1);
+        if (run->handles[pid] == NULL) return;
+    }
+
+    int addr = pick_addr(run, in, pid), size = pick_size(in), seed = next_byte(in);
+    char* buf = malloc(size), * ref_buf = malloc(size);
+    fill(buf, size, seed);
+    memcpy(ref_buf, buf, size);
+    // The pid of a stale handle may have been reused, the reference model must not be asked
+    int ret = write ? vm_write_handle(run->handles[pid], (char*) (long) addr, size, buf)
+                    : vm_read_handle(run->handles[pid], (char*) (long) addr, size, buf);
+    int ref_ret = run->stale[pid] ? -1 : write ? ref_vm_write(run->ref, pid, (char*) (long) addr, size, ref_buf)
+                                               : ref_vm_read(run->ref, pid, (char*) (long) addr, size, ref_buf);
+    check_ret(run, ret, ref_ret);
+    if (ret == 0) {
+        if (write) mark_written(run, pid, addr, size);
+        else check_read(run, pid, addr, size, buf, ref_buf);
+    }
+    free(buf);
+    free(ref_buf);
+}
+
+/* Frame buffers are lent out of the capacity: a frame lent is one the processes can no longer fault in. */
+static void op_lend(struct Run* run, struct Input* in) {
+    if (next_byte(in) % 2 == 0 && run->lent_num > 0) {
+        --run->lent_num;
+        if (kernel_free_frame_buffer(run->kernel, run->lent[run->lent_num]) == -1) fail(run, "frame buffer not taken back");
+        ref_free_frame_buffer(run->ref, run->ref_lent[run->lent_num]);
+        return;
+    }
+    if (run->lent_num == MAX_LENT) return;
+    char* buf = kernel_alloc_frame_buffer(run->kernel);
+    int pfn = ref_alloc_frame_buffer(run->ref);
+    check_ret(run, buf == NULL ? -1 : 0, pfn == -1 ? -1 : 0);
+    if (buf == NULL) return;
+    run->lent[run->lent_num] = buf;
+    run->ref_lent[run->lent_num++] = pfn;
+}
+
+/* Strided accesses are checked against their meaning: one access per element, in order, all checked up front. */
+static void op_strided(struct Run* run, struct Input* in, int write) {
+    int pid = next_byte(in) % (MAX_PROCESS_NUM + 1);
+    int base = pick_addr(run, in, pid), elem_size = next_byte(in) % PAGE_SIZE + 1;
+    int stride = elem_size + next_u16(in) % (2 * PAGE_SIZE) - 1, count = next_byte(in) % 16 + 1, seed = next_byte(in);
+    int size = elem_size * count;
+    char* buf = malloc(size), * ref_buf = malloc(size);
+    fill(buf, size, seed);
+    memcpy(ref_buf, buf, size);
+
+    int ret = write ? vm_write_strided(run->kernel, pid, (char*) (long) base, elem_size, stride, count, buf)
+                    : vm_read_strided(run->kernel, pid, (char*) (long) base, elem_size, stride, count, buf);
+    int ref_ret = -1;
+    if (stride >= elem_size && pid < MAX_PROCESS_NUM && run->ref->running[pid]
+        && (long long) base + (long long) (count - 1) * stride + elem_size <= run->ref->mm[pid].size) {
+        ref_ret = 0;
+        for (int i = 0; i < count; ++i) {
+            char* addr = (char*) (long) base + (long) i * stride;
+            if (write) ref_vm_write(run->ref, pid, addr, elem_size, ref_buf + i * elem_size);
+            else ref_vm_read(run->ref, pid, addr, elem_size, ref_buf + i * elem_size);
+        }
+    }
+    check_ret(run, ret, ref_ret);
+    if (ret == 0)
+        for (int i = 0; i < count; ++i) {
+            if (write) mark_written(run, pid, base + i * stride, elem_size);
+            else check_read(run, pid, base + i * stride, elem_size, buf + i * elem_size, ref_buf + i * elem_size);
+        }
+    free(buf);
+    free(ref_buf);
+}
+
+/* Batches are checked against their meaning: the accesses one after another, up to the first failure. */
+static void op_batch(struct Run* run, struct Input* in, int write) {
+    int n = next_byte(in) % MAX_BATCH + 1;
+    struct VMAccess accesses[MAX_BATCH];
+    char* ref_bufs[MAX_BATCH];
+    for (int i = 0; i < n; ++i) {
+        int pid = next_byte(in) % (MAX_PROCESS_NUM + 1);
+        int addr = pick_addr(run, in, pid), size = next_byte(in) % (2 * PAGE_SIZE) + 1;
+        accesses[i] = (struct VMAccess) {pid, (char*) (long) addr, size, malloc(size)};
+        ref_bufs[i] = malloc(size);
+        fill(accesses[i].buf, size, next_byte(in));
+        memcpy(ref_bufs[i], accesses[i].buf, size);
+    }
+
+    int done = write ? vm_write_batch(run->kernel, accesses, n) : vm_read_batch(run->kernel, accesses, n), ref_done = 0;
+    for (; ref_done < n; ++ref_done) {
+        struct VMAccess* access = &accesses[ref_done];
+        int ret = write ? ref_vm_write(run->ref, access->pid, access->addr, access->size, ref_bufs[ref_done])
+                        : ref_vm_read(run->ref, access->pid, access->addr, access->size, ref_bufs[ref_done]);
+        if (ret == -1) break;
+    }
+    check_ret(run, done, ref_done);
+    for (int i = 0; i < n; ++i) {
+        if (i < done) {
+            if (write) mark_written(run, accesses[i].pid, (int) (long) accesses[i].addr, accesses[i].size);
+            else check_read(run, accesses[i].pid, (int) (long) accesses[i].addr, accesses[i].size, accesses[i].buf, ref_bufs[i]);
+        }
+        free(accesses[i].buf);
+        free(ref_bufs[i]);
+    }
+}
+
+/* This function will replay an input against the reference model and the kernel in one configuration. */
+static void run_config(struct Config* config, const uint8_t* data, size_t size) {
+    PARALLEL_COPY_THRESHOLD = config->parallel_copy_threshold;
+    PARALLEL_COPY_THREADS = config->parallel_copy_threads;
+    ALLOC_POLICY = config->alloc_policy;
+    FAULT_AROUND_PAGES = config->fault_around_pages;
+    HOT_FRAMES = config->hot_frames;
+    PREFETCH_PAGES = config->prefetch_pages;
+    ZERO_PAGE_DETECTION = config->zero_page_detection;
+    FREE_PAGE_REPORTING_BATCH = config->free_page_reporting_batch;
+    REPLACEMENT_POLICY = config->replacement_policy;
+
+    struct Input in = {data, size, 0};
+    PAGE_SIZE = PAGE_SIZES[next_byte(&in) % (sizeof(PAGE_SIZES) / sizeof(int))];
+    VIRTUAL_SPACE_SIZE = PAGES_PER_PROCESS * PAGE_SIZE;
+    KERNEL_SPACE_SIZE = FRAMES * PAGE_SIZE;
+    MAX_PROCESS_NUM = PROCESSES;
+
+    // The reference model gets all FRAMES as frames, the kernel as many frames and swap slots
+    struct Run run = {config, NULL, ref_init_kernel(), {NULL}, {NULL}, {0}, 0, {NULL}, {0}, 0};
+    KERNEL_SPACE_SIZE = (FRAMES - config->swap_slots) * PAGE_SIZE;
+    run.kernel = init_kernel();
+    if (config->swap_slots > 0) {
+        // Only the open descriptor is used, the file goes away with the kernel even when a run aborts
+        char path[64];
+        sprintf(path, "/tmp/fuzz-swap-%d", (int) getpid());
+        if (swap_add(run.kernel, path, config->swap_slots, 0) == -1) {
+            perror(path);
+            exit(1);
+        }
+        unlink(path);
+    }
+
+    for (; in.pos < in.size; ++run.op) {
+        int op = next_byte(&in) % 13;
+        if (op == 0) op_create(&run, &in);
+        else if (op == 1) op_exit(&run, &in);
+        else if (op <= 5) op_access(&run, &in, op >= 4);
+        else if (op <= 7) op_strided(&run, &in, op == 7);
+        else if (op <= 9) op_batch(&run, &in, op == 9);
+        else if (op == 10) op_lend(&run, &in);
+        else op_handle(&run, &in, op == 12);
+
+        check_consistency(&run);
+        if (config->same >= SAME_FRAMES) check_frames(&run);
+    }
+
+    for (int i = 0; i < PROCESSES; ++i) {
+        if (run.handles[i] != NULL) proc_close(run.handles[i]);
+        free(run.written[i]);
+    }
+    destroy_kernel(run.kernel);
+    ref_destroy_kernel(run.ref);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    current_data = data;
+    current_size = size;
+    int kernel_space_size = KERNEL_SPACE_SIZE, virtual_space_size = VIRTUAL_SPACE_SIZE, page_size = PAGE_SIZE, max_process_num = MAX_PROCESS_NUM;
+    int replacement_policy = REPLACEMENT_POLICY;
+    for (int i = 0; i < (int) (sizeof(CONFIGS) / sizeof(struct Config)); ++i) run_config(&CONFIGS[i], data, size);
+
+    KERNEL_SPACE_SIZE = kernel_space_size;
+    VIRTUAL_SPACE_SIZE = virtual_space_size;
+    PAGE_SIZE = page_size;
+    MAX_PROCESS_NUM = max_process_num;
+    REPLACEMENT_POLICY = replacement_policy;
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static int replay(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    int cap = 4096, size = 0;
+    uint8_t* data = malloc(cap);
+    for (int n; (n = fread(data + size, 1, cap - size, file)) > 0;)
+        if ((size += n) == cap) data = realloc(data, cap *= 2);
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int runs = 10000, max_len = 512, opt;
+    unsigned int seed = time(NULL);
+    while ((opt = getopt(argc, argv, "n:s:l:")) != -1) {
+        if (opt == 'n') runs = atoi(optarg);
+        else if (opt == 's') seed = strtoul(optarg, NULL, 10);
+        else if (opt == 'l') max_len = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-n runs] [-s seed] [-l max input length] [input file...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; ++i)
+            if (replay(argv[i]) == -1) return 1;
+        printf("fuzz: %d inputs replayed, no difference\n", argc - optind);
+        return 0;
+    }
+
+    printf("fuzz: seed %u\n", seed);
+    uint8_t* data = malloc(max_len);
+    for (int i = 0; i < runs; ++i) {
+        int size = rand_r(&seed) % max_len + 1;
+        for (int j = 0; j < size; ++j) data[j] = rand_r(&seed);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    free(data);
+    printf("fuzz: %d runs, no difference\n", runs);
+    return 0;
+}
+#endif
@@ -0,0 +1,163 @@
+#include "kernel.h"
+
+/* Heap layout in the user space of a process (all fields are int64_t):
+ *   [0]  magic          [8]  top (first never-used address)
+ *   [16] free lists of the 8 small size classes (16, 32, ..., 2048 bytes)
+ *   [80] free list of large spans (first fit)
+ * A small block is [tag][payload...], the payload address is returned and holds the next pointer while free.
+ * A large span is page-aligned [next][tag][payload...], its tag is its size which is always > 2048.
+ * The tag of a block is its size, with HEAP_FREE set while the block is free (sizes are even),
+ * and a free list ends with 0 (never a block address).
+ * The process can overwrite all of it, so large spans are checked against the kernel's record (MMStruct heap_spans)
+ * before a span is handed out or punched. */
+#define HEAP_MAGIC 0x4b50554865617021LL
+#define HEAP_TOP 8
+#define HEAP_SMALL_FREE 16
+#define HEAP_LARGE_FREE 80
+#define HEAP_NUM_CLASSES 8
+#define HEAP_MIN_CLASS 16
+#define HEAP_FREE 1
+
+static int heap_load(struct Kernel* kernel, int pid, long long addr, int64_t* val) {
+    return vm_read(kernel, pid, (char*) addr, sizeof(int64_t), (char*) val);
+}
+
+static int heap_store(struct Kernel* kernel, int pid, long long addr, int64_t val) {
+    return vm_write(kernel, pid, (char*) addr, sizeof(int64_t), (char*) &val);
+}
+
+/* This function will set up the heap header of a user-specified process if it is not there yet,
+ * returns 0 when succeeded, -1 when failed. */
+static int heap_init(struct Kernel* kernel, int pid) {
+    int64_t magic;
+    if (heap_load(kernel, pid, 0, &magic) == -1) return -1;
+    if (magic == HEAP_MAGIC) return 0;
+
+    char header[HEAP_HEADER_SIZE] = {0};
+    *(int64_t*) header = HEAP_MAGIC;
+    *(int64_t*) (header + HEAP_TOP) = HEAP_HEADER_SIZE;
+    return vm_write(kernel, pid, 0, HEAP_HEADER_SIZE, header);
+}
+
+/* This function will carve size bytes aligned to align from the never-used part of the heap,
+ * returns the address when succeeded, 0 when failed. */
+static long long heap_bump(struct Kernel* kernel, int pid, long long size, long long align) {
+    int64_t top;
+    if (heap_load(kernel, pid, HEAP_TOP, &top) == -1) return 0;
+
+    long long block = (top + align - 1) / align * align;
+    if (block + size > kernel->mm[pid].size) return 0;
+    if (heap_store(kernel, pid, HEAP_TOP, block + size) == -1) return 0;
+    return block;
+}
+
+/* This function will tell the heap span record of a user-specified process, set up on first use. */
+static int* heap_spans(struct Kernel* kernel, int pid) {
+    if (kernel->mm[pid].heap_spans == NULL)
+        kernel->mm[pid].heap_spans = calloc((kernel->mm[pid].size - 1) / PAGE_SIZE + 1, sizeof(int));
+    return kernel->mm[pid].heap_spans;
+}
+
+static char* heap_malloc_small(struct Kernel* kernel, int pid, int size) {
+    int cls = 0;
+    while ((HEAP_MIN_CLASS << cls) < size + 8) ++cls;
+    long long class_size = HEAP_MIN_CLASS << cls, list = HEAP_SMALL_FREE + 8 * cls;
+
+    // Reuse a freed block of the same class first
+    int64_t payload, next;
+    if (heap_load(kernel, pid, list, &payload) == -1) return NULL;
+    if (payload != 0) {
+        if (heap_load(kernel, pid, payload, &next) == -1) return NULL;
+        if (heap_store(kernel, pid, list, next) == -1 || heap_store(kernel, pid, payload - 8, class_size) == -1) return NULL;
+        return (char*) payload;
+    }
+
+    long long block = heap_bump(kernel, pid, class_size, HEAP_MIN_CLASS);
+    if (block == 0 || heap_store(kernel, pid, block, class_size) == -1) return NULL;
+    return (char*) (block + 8);
+}
+
+static char* heap_malloc_large(struct Kernel* kernel, int pid, int size) {
+    long long span_size = ((long long) size + 16 + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    int* spans = heap_spans(kernel, pid);
+
+    // First fit over the freed spans, the tail of a bigger span stays on the list
+    int64_t prev = HEAP_LARGE_FREE, span, next, tag;
+    if (heap_load(kernel, pid, prev, &span) == -1) return NULL;
+    while (span != 0) {
+        if (heap_load(kernel, pid, span, &next) == -1 || heap_load(kernel, pid, span + 8, &tag) == -1) return NULL;
+        tag &= ~HEAP_FREE;
+        // A free span the kernel does not know of was forged, the list cannot be trusted past it
+        if (span < 0 || span >= kernel->mm[pid].size || span % PAGE_SIZE || -(long long) spans[span / PAGE_SIZE] * PAGE_SIZE != tag) return NULL;
+        if (tag >= span_size) {
+            if (tag - span_size > HEAP_MAX_SMALL + 8) {
+                long long rest = span + span_size;
+                if (heap_store(kernel, pid, rest, next) == -1 || heap_store(kernel, pid, rest + 8, (tag - span_size) | HEAP_FREE) == -1) return NULL;
+                spans[rest / PAGE_SIZE] = -(tag - span_size) / PAGE_SIZE;
+                tag = span_size;
+                next = rest;
+            }
+            if (heap_store(kernel, pid, prev, next) == -1 || heap_store(kernel, pid, span + 8, tag) == -1) return NULL;
+            spans[span / PAGE_SIZE] = tag / PAGE_SIZE;
+            return (char*) (span + 16);
+        }
+        prev = span;
+        span = next;
+    }
+
+    span = heap_bump(kernel, pid, span_size, PAGE_SIZE);
+    if (span == 0 || heap_store(kernel, pid, span + 8, span_size) == -1) return NULL;
+    spans[span / PAGE_SIZE] = span_size / PAGE_SIZE;
+    return (char*) (span + 16);
+}
+
+/* This function will allocate size bytes from the heap in the user space of a user-specified process,
+ * returns the user space address when succeeded, NULL when failed. */
+char* vm_malloc(struct Kernel* kernel, int pid, int size) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return NULL;
+    if (size <= 0 || heap_init(kernel, pid) == -1) return NULL;
+
+    if (size <= HEAP_MAX_SMALL) return heap_malloc_small(kernel, pid, size);
+    return heap_malloc_large(kernel, pid, size);
+}
+
+/* This function will give a block allocated by vm_malloc back to the heap of a user-specified process,
+ * the whole pages of a large span are hole-punched so their frames are released right away,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_free(struct Kernel* kernel, int pid, char* addr) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+
+    long long payload = (long long) addr;
+    int64_t magic, top, tag;
+    if (payload < HEAP_HEADER_SIZE + 8 || heap_load(kernel, pid, 0, &magic) == -1 || magic != HEAP_MAGIC) return -1;
+    if (heap_load(kernel, pid, HEAP_TOP, &top) == -1 || payload >= top) return -1;
+    if (heap_load(kernel, pid, payload - 8, &tag) == -1) return -1;
+    // Freed already
+    if (tag & HEAP_FREE) return -1;
+
+    // A small block, its tag is its class size
+    if (tag <= HEAP_MAX_SMALL + 8) {
+        int cls = 0;
+        while ((HEAP_MIN_CLASS << cls) < tag) ++cls;
+        if (cls >= HEAP_NUM_CLASSES || (HEAP_MIN_CLASS << cls) != tag || (payload - 8) % HEAP_MIN_CLASS) return -1;
+
+        int64_t head;
+        long long list = HEAP_SMALL_FREE + 8 * cls;
+        if (heap_load(kernel, pid, list, &head) == -1) return -1;
+        if (heap_store(kernel, pid, payload, head) == -1 || heap_store(kernel, pid, payload - 8, tag | HEAP_FREE) == -1) return -1;
+        return heap_store(kernel, pid, list, payload);
+    }
+
+    // A large span, only as the kernel recorded it: the header may have been forged to punch anything else
+    long long span = payload - 16;
+    if (span % PAGE_SIZE || tag % PAGE_SIZE || span + tag > top) return -1;
+    int* spans = kernel->mm[pid].heap_spans;
+    if (spans == NULL || (long long) spans[span / PAGE_SIZE] * PAGE_SIZE != tag) return -1;
+
+    int64_t head;
+    if (heap_load(kernel, pid, HEAP_LARGE_FREE, &head) == -1) return -1;
+    if (heap_store(kernel, pid, span, head) == -1 || heap_store(kernel, pid, span + 8, tag | HEAP_FREE) == -1) return -1;
+    if (heap_store(kernel, pid, HEAP_LARGE_FREE, span) == -1) return -1;
+    spans[span / PAGE_SIZE] = -spans[span / PAGE_SIZE];
+    return vm_punch_hole(kernel, pid, (char*) payload, tag - 16);
+}
@@ -1,5 +1,408 @@
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "kernel.h"
 
+/* This function will mark a free frame as taken. */
+static int take_frame(struct Kernel* kernel, int pfn) {
+    kernel->occupied_pages[pfn] = 1;
+    --kernel->free_frames;
+    // Whatever a clone left in the frame is garbage now, stop looking it up
+    if (kernel->cow != NULL) kernel->cow[pfn] = 0;
+    kernel->free_seen[pfn] = kernel->reported[pfn] = 0;
+    return pfn;
+}
+
+/* This function will take a free page of kernel-managed memory,
+ * the most recently freed one still free (hot list, while its cache lines may be warm) if any,
+ * else the first one (first fit policy) or the first one after the last taken (next fit policy) depending on ALLOC_POLICY,
+ * returns its PFN when succeeded, -1 when failed. */
+static int alloc_frame(struct Kernel* kernel) {
+    while (kernel->hot_num > 0) {
+        kernel->hot_top = (kernel->hot_top + kernel->hot_cap - 1) % kernel->hot_cap;
+        --kernel->hot_num;
+        // A frame may have been taken by a scan since it was freed
+        if (!kernel->occupied_pages[kernel->hot[kernel->hot_top]]) return take_frame(kernel, kernel->hot[kernel->hot_top]);
+    }
+
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE, start = ALLOC_POLICY == ALLOC_NEXT_FIT ? kernel->next_fit : 0;
+    for (int n = 0, j = start; n < frames; ++n, j = j + 1 < frames ? j + 1 : 0)
+        if (!kernel->occupied_pages[j]) {
+            kernel->next_fit = j + 1 < frames ? j + 1 : 0;
+            return take_frame(kernel, j);
+        }
+    return -1;
+}
+
+/* This function will give a frame back to the free pool. */
+static void free_frame(struct Kernel* kernel, int pfn) {
+    kernel->occupied_pages[pfn] = 0;
+    ++kernel->free_frames;
+    // The oldest entry of a full hot list is overwritten, it is cold by now
+    if (kernel->hot_cap > 0) {
+        kernel->hot[kernel->hot_top] = pfn;
+        kernel->hot_top = (kernel->hot_top + 1) % kernel->hot_cap;
+        kernel->hot_num = min(kernel->hot_num + 1, kernel->hot_cap);
+    }
+    if (FREE_PAGE_REPORTING_BATCH > 0 && ++kernel->freed_since_report >= FREE_PAGE_REPORTING_BATCH)
+        kernel_report_free_pages(kernel);
+}
+
+/* This function will give the frame behind a present PTE back, to the free pool or, for host memory, to the caller,
+ * for a swapped out PTE, its swap slot is given back instead.
+ * The PTE itself is left untouched. */
+static void release_frame(struct Kernel* kernel, struct PTE* pte) {
+    if (pte->swapped) swap_slot_put(kernel->swap, pte->PFN);
+    else if (pte->foreign) {
+        int slot = pte->PFN - KERNEL_SPACE_SIZE / PAGE_SIZE;
+        kernel->foreign_frames[slot] = NULL;
+        kernel->foreign_free[kernel->foreign_free_num++] = slot;
+    }
+    else free_frame(kernel, pte->PFN);
+}
+
+/* This function will give back the frame or swap slot behind a PTE of a user-specified process,
+ * a frame of a real-time process goes back to its reserved pool instead of the free pool. */
+static void release_page(struct Kernel* kernel, int pid, struct PTE* pte) {
+    if (kernel->mm[pid].rt_pool != NULL && pte->present && !pte->foreign)
+        kernel->mm[pid].rt_pool[kernel->mm[pid].rt_pool_num++] = pte->PFN;
+    else release_frame(kernel, pte);
+}
+
+/* This function will give back every frame of a user-specified process and drop its page table,
+ * the swap slots stay with the page table as long as a clone still shares it. */
+static void release_page_table(struct Kernel* kernel, int pid) {
+    struct PageTable* page_table = kernel->mm[pid].page_table;
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    for (int i = 0; i < no_of_pages; ++i)
+        if (page_table->ptes[i].present || (page_table->ptes[i].swapped && page_table->refs == 1))
+            release_frame(kernel, &page_table->ptes[i]);
+    for (int i = 0; i < kernel->mm[pid].rt_pool_num; ++i) free_frame(kernel, kernel->mm[pid].rt_pool[i]);
+    free(kernel->mm[pid].rt_pool);
+    kernel->mm[pid].rt_pool = NULL;
+    kernel->mm[pid].rt_pool_num = 0;
+
+    if (--page_table->refs == 0) {
+        free(page_table->ptes);
+        free(page_table);
+    }
+    kernel->mm[pid].page_table = NULL;
+    ++kernel->map_epoch;
+}
+
+/* This function will give a user-specified process its own copy of a page table shared with a clone (copy-on-write),
+ * returns the now private page table. */
+static struct PageTable* unshare_page_table(struct Kernel* kernel, int pid) {
+    struct PageTable* page_table = kernel->mm[pid].page_table;
+    if (page_table->refs == 1) return page_table;
+
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    struct PageTable* copy = malloc(sizeof(struct PageTable));
+    copy->ptes = malloc(sizeof(struct PTE) * no_of_pages);
+    memcpy(copy->ptes, page_table->ptes, sizeof(struct PTE) * no_of_pages);
+    copy->refs = 1;
+    for (int i = 0; i < no_of_pages; ++i)
+        if (copy->ptes[i].swapped) swap_slot_get(kernel->swap, copy->ptes[i].PFN);
+
+    --page_table->refs;
+    kernel->mm[pid].page_table = copy;
+    ++kernel->map_epoch;
+    return copy;
+}
+
+/* This function will return the address of a frame's content,
+ * for a write, a frame still shared with a clone (copy-on-write) is copied into kernel->space first,
+ * PFNs past the end of kernel->space are host memory attached by vm_attach_host_memory. */
+char* frame_ptr(struct Kernel* kernel, int pfn, int write) {
+    if (pfn >= KERNEL_SPACE_SIZE / PAGE_SIZE) return kernel->foreign_frames[pfn - KERNEL_SPACE_SIZE / PAGE_SIZE];
+    if (kernel->cow == NULL || !kernel->cow[pfn]) return kernel->space + PAGE_SIZE * pfn;
+
+    struct FrameStore* store = kernel->base;
+    while (store->cow != NULL && store->cow[pfn]) store = store->base;
+    if (!write) return store->space + PAGE_SIZE * pfn;
+
+    memcpy(kernel->space + PAGE_SIZE * pfn, store->space + PAGE_SIZE * pfn, PAGE_SIZE);
+    kernel->cow[pfn] = 0;
+    return kernel->space + PAGE_SIZE * pfn;
+}
+
+/* This function will write a present page of a user-specified process to a free swap slot,
+ * or to the slot entry (whose one reference it takes over) unless entry is -1,
+ * returns the PFN of the now free (and still occupied) frame when succeeded, -1 when failed. */
+static int swap_out(struct Kernel* kernel, int pid, int page, int entry) {
+    int pfn = kernel->mm[pid].page_table->ptes[page].PFN, own = entry == -1;
+    if (own) entry = swap_alloc_slot(kernel->swap);
+    if (entry == -1) return -1;
+    if (swap_write_page(kernel->swap, entry, frame_ptr(kernel, pfn, 0)) == -1) {
+        if (own) swap_slot_put(kernel->swap, entry);
+        return -1;
+    }
+
+    struct PTE* pte = &unshare_page_table(kernel, pid)->ptes[page];
+    pte->PFN = entry;
+    pte->present = 0;
+    pte->swapped = 1;
+    ++kernel->map_epoch;
+    if (kernel->cow != NULL) kernel->cow[pfn] = 0;
+    return pfn;
+}
+
+/* This function will swap out the first page the clock hand finds not accessed since its last pass
+ * (REPLACE_CLOCK), or simply the next present page under the hand (REPLACE_FIFO), to entry as swap_out does,
+ * returns the PFN of the now free (and still occupied) frame when succeeded, -1 when failed (no swap or swap full). */
+static int swap_out_page(struct Kernel* kernel, int entry) {
+    if (kernel->swap == NULL) return -1;
+
+    // Two passes over every process at most, the first one may only clear accessed bits
+    for (int round = 0; round <= 2 * MAX_PROCESS_NUM; ++round) {
+        int pid = kernel->clock_pid;
+        // The pages of a real-time process are never swapped out
+        if (kernel->running[pid] && kernel->mm[pid].rt_pool == NULL && kernel->mm[pid].hibernate_fd == -1) {
+            int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+            for (; kernel->clock_page < no_of_pages; ++kernel->clock_page) {
+                struct PTE* pte = &kernel->mm[pid].page_table->ptes[kernel->clock_page];
+                if (!pte->present || pte->foreign) continue;
+                if (pte->accessed && REPLACEMENT_POLICY == REPLACE_CLOCK) {
+                    pte->accessed = 0;
+                    continue;
+                }
+
+                return swap_out(kernel, pid, kernel->clock_page++, entry);
+            }
+        }
+        kernel->clock_page = 0;
+        kernel->clock_pid = (pid + 1) % MAX_PROCESS_NUM;
+    }
+    return -1;
+}
+
+/* This function will read a swapped out page of a user-specified process in ahead of its use,
+ * returns 0 when succeeded, -1 when failed (nothing to read or no frame). */
+static int read_ahead(struct Kernel* kernel, int pid, int page) {
+    if (!kernel->mm[pid].page_table->ptes[page].swapped) return -1;
+    int pfn = alloc_frame(kernel);
+    if (pfn == -1) pfn = swap_out_page(kernel, -1);
+    if (pfn == -1) return -1;
+
+    struct PTE* pte = &kernel->mm[pid].page_table->ptes[page];
+    if (swap_read_page(kernel->swap, pte->PFN, frame_ptr(kernel, pfn, 1)) == -1) {
+        free_frame(kernel, pfn);
+        return -1;
+    }
+
+    pte = &unshare_page_table(kernel, pid)->ptes[page];
+    swap_slot_put(kernel->swap, pte->PFN);
+    if (pte->cold) ++kernel->cold_refaults;
+    pte->swapped = 0;
+    pte->cold = 0;
+    pte->idle_age = 0;
+    pte->PFN = pfn;
+    pte->present = 1;
+    // Cleared, so that an access tells a hit
+    pte->accessed = 0;
+    return 0;
+}
+
+/* This function will judge the pages read in ahead so far, turning prefetching off for a while when it misses. */
+static void judge_prefetches(struct Kernel* kernel, int pid, struct Prefetcher* prefetcher) {
+    struct PTE* ptes = kernel->mm[pid].page_table->ptes;
+    for (int i = 0; i < prefetcher->pending_num; ++i) {
+        struct PTE* pte = &ptes[prefetcher->pending[i]];
+        int hit = pte->present && pte->accessed;
+        if (!hit && pte->present && prefetcher->faults - prefetcher->pending_fault[i] < PREFETCH_HISTORY) continue;
+
+        if (hit) ++prefetcher->stats.hits, ++prefetcher->window_hits;
+        else ++prefetcher->stats.misses, ++prefetcher->window_misses;
+        prefetcher->pending[i] = prefetcher->pending[--prefetcher->pending_num];
+        prefetcher->pending_fault[i] = prefetcher->pending_fault[prefetcher->pending_num];
+        --i;
+    }
+
+    if (prefetcher->window_hits + prefetcher->window_misses >= 32) {
+        if (prefetcher->window_misses * 2 >= prefetcher->window_hits + prefetcher->window_misses)
+            prefetcher->off_until = prefetcher->faults + 256;
+        prefetcher->window_hits = prefetcher->window_misses = 0;
+    }
+}
+
+/* This function will feed a fault of a user-specified process to its prefetcher,
+ * then read in the swapped out pages it predicts to be accessed next. */
+static void prefetch(struct Kernel* kernel, int pid, int page) {
+    struct Prefetcher* prefetcher = kernel->mm[pid].prefetcher;
+    if (prefetcher == NULL) {
+        prefetcher = kernel->mm[pid].prefetcher = calloc(1, sizeof(struct Prefetcher));
+        for (int i = 0; i < PREFETCH_HISTORY; ++i) prefetcher->seq_page[i] = -1;
+        prefetcher->last_page = -1;
+    }
+    ++prefetcher->faults;
+    judge_prefetches(kernel, pid, prefetcher);
+
+    // Learn from the fault
+    if (prefetcher->last_page != -1) {
+        int stride = page - prefetcher->last_page;
+        prefetcher->stride_confirmed = stride != 0 && stride == prefetcher->stride;
+        prefetcher->stride = stride;
+        prefetcher->seq_page[prefetcher->last_page % PREFETCH_HISTORY] = prefetcher->last_page;
+        prefetcher->seq_next[prefetcher->last_page % PREFETCH_HISTORY] = page;
+    }
+    prefetcher->last_page = page;
+    prefetcher->stats.enabled = prefetcher->faults >= prefetcher->off_until;
+    if (!prefetcher->stats.enabled || kernel->swap == NULL) return;
+
+    // Predict: along the stride, or along what followed this fault last time
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    for (int n = 0, next = page; n < PREFETCH_PAGES && prefetcher->pending_num < PREFETCH_HISTORY; ++n) {
+        if (prefetcher->stride_confirmed) next += prefetcher->stride;
+        else if (prefetcher->seq_page[next % PREFETCH_HISTORY] == next) next = prefetcher->seq_next[next % PREFETCH_HISTORY];
+        else break;
+        if (0 > next || next >= no_of_pages) break;
+        if (next == page) continue;
+
+        if (read_ahead(kernel, pid, next) == -1) continue;
+        prefetcher->pending[prefetcher->pending_num] = next;
+        prefetcher->pending_fault[prefetcher->pending_num++] = prefetcher->faults;
+        ++prefetcher->stats.issued;
+    }
+}
+
+/* This function will build the translation of a virtual page of a user-specified process if it is not present yet,
+ * swapping a page out if there's no free frame and the page itself back in if it was swapped out,
+ * returns the PFN it maps to when succeeded, -1 when failed. */
+static int map_page(struct Kernel* kernel, int pid, int page) {
+    struct PTE* pte = &kernel->mm[pid].page_table->ptes[page];
+    if (!pte->present) {
+        if (kernel->mm[pid].throttle != NULL) throttle_charge(kernel->mm[pid].throttle, 0, 1);
+        // Before the page gets its frame, so that the read ahead cannot evict it
+        if (PREFETCH_PAGES > 0 && kernel->mm[pid].rt_pool == NULL) prefetch(kernel, pid, page);
+        pte = &unshare_page_table(kernel, pid)->ptes[page];
+        // A real-time process only ever takes a frame from its own reserved pool, in O(1)
+        int pfn = kernel->mm[pid].rt_pool_num > 0 ? kernel->mm[pid].rt_pool[--kernel->mm[pid].rt_pool_num] : alloc_frame(kernel);
+        if (pfn != -1 && kernel->cow != NULL) kernel->cow[pfn] = 0;
+        char* bounce = NULL;
+        if (pfn == -1 && kernel->swap != NULL) {
+            long long start = pressure_clock();
+            pfn = swap_out_page(kernel, -1);
+            // Swap is full: the page coming in hands its slot (unless a clone shares it) to the page going out
+            struct SwapDevice* dev = pte->swapped ? &kernel->swap->devices[SWAP_DEV(pte->PFN)] : NULL;
+            if (pfn == -1 && dev != NULL && dev->slot_refs[SWAP_SLOT(pte->PFN)] == 1) {
+                bounce = malloc(PAGE_SIZE);
+                if (swap_read_page(kernel->swap, pte->PFN, bounce) == 0) pfn = swap_out_page(kernel, pte->PFN);
+                if (pfn == -1) {
+                    free(bounce);
+                    bounce = NULL;
+                }
+            }
+            pressure_record(kernel, start, 1);
+        }
+        if (pfn == -1) return -1;
+
+        if (bounce != NULL) {
+            memcpy(frame_ptr(kernel, pfn, 1), bounce, PAGE_SIZE);
+            free(bounce);
+            pte->swapped = 0;
+            if (pte->cold) ++kernel->cold_refaults;
+        }
+        else if (pte->swapped) {
+            long long start = pressure_clock();
+            int failed = swap_read_page(kernel->swap, pte->PFN, frame_ptr(kernel, pfn, 1)) == -1;
+            pressure_record(kernel, start, 0);
+            if (failed) {
+                free_frame(kernel, pfn);
+                return -1;
+            }
+            swap_slot_put(kernel->swap, pte->PFN);
+            pte->swapped = 0;
+            if (pte->cold) ++kernel->cold_refaults;
+        }
+        else if (pte->zero) memset(frame_ptr(kernel, pfn, 1), 0, PAGE_SIZE);
+        pte->zero = 0;
+        pte->cold = 0;
+        pte->idle_age = 0;
+        pte->PFN = pfn;
+        pte->present = 1;
+
+        // Fault-around: map the following untouched pages too while free frames are at hand
+        struct PTE* ptes = kernel->mm[pid].page_table->ptes;
+        int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+        for (int i = page + 1; i <= page + FAULT_AROUND_PAGES && i < no_of_pages && kernel->mm[pid].rt_pool == NULL; ++i) {
+            if (ptes[i].present || ptes[i].swapped || ptes[i].zero) break;
+            int around = alloc_frame(kernel);
+            if (around == -1) break;
+            ptes[i].PFN = around;
+            ptes[i].present = 1;
+        }
+        if (kernel->pressure->trigger_num > 0) pressure_check(kernel, 0);
+    }
+    pte->accessed = 1;
+    return pte->PFN;
+}
+
+/* This function will tell if the size bytes at buf are all zeros, 64 bytes at a time (SSE2 when available). */
+int is_zero(const char* buf, int size) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= size; i += 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*) (buf + i)), _mm_loadu_si128((const __m128i*) (buf + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i*) (buf + i + 32)), _mm_loadu_si128((const __m128i*) (buf + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) return 0;
+    }
+#endif
+    for (; i < size; ++i)
+        if (buf[i]) return 0;
+    return 1;
+}
+
+/* This function will turn a page of a user-specified process into a zero page, releasing its frame or swap slot. */
+static void zero_page(struct Kernel* kernel, int pid, int page) {
+    if (kernel->mm[pid].page_table->ptes[page].zero) return;
+
+    struct PTE* pte = &unshare_page_table(kernel, pid)->ptes[page];
+    if (pte->present || pte->swapped) {
+        release_page(kernel, pid, pte);
+        ++kernel->map_epoch;
+    }
+    pte->PFN = -1;
+    pte->present = 0;
+    pte->swapped = 0;
+    pte->cold = 0;
+    pte->zero = 1;
+}
+
+/* This function will tell if a write of [lo, hi) from buf covers a whole page of a user-specified process with zeros,
+ * which ZERO_PAGE_DETECTION turns into a zero page instead of copying it. */
+static int writes_zero_page(struct Kernel* kernel, int pid, int page, long long lo, long long hi, const char* buf) {
+    return ZERO_PAGE_DETECTION && lo % PAGE_SIZE == 0 && (hi % PAGE_SIZE == 0 || hi == kernel->mm[pid].size)
+           && !kernel->mm[pid].page_table->ptes[page].foreign && is_zero(buf, hi - lo);
+}
+
+/* This function will copy size bytes at offset of a frame to buf, a NULL frame being a zero page. */
+static void copy_out(char* buf, const char* frame, int offset, int size) {
+    if (frame == NULL) memset(buf, 0, size);
+    else memcpy(buf, frame + offset, size);
+}
+
+/* This function will tell if no_of_pages more pages fit in what the processes may reserve:
+ * every frame and the swap slots not counted on by the other kernels sharing the area, less the frames lent out. */
+static int fits(struct Kernel* kernel, int no_of_pages) {
+    int capacity = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    if (kernel->swap != NULL) capacity += kernel->swap->total_slots - (kernel->swap->reserved - swap_reserved(kernel));
+    return kernel->allocated_pages + kernel->lent_num + no_of_pages <= capacity;
+}
+
+/* This function will add no_of_pages pages and lent_num lent frames to what a kernel reserves (< 0 to give them back),
+ * keeping the slots counted on in its swap area up to date. */
+static void reserve(struct Kernel* kernel, int no_of_pages, int lent_num) {
+    if (kernel->swap != NULL) kernel->swap->reserved -= swap_reserved(kernel);
+    kernel->allocated_pages += no_of_pages;
+    kernel->lent_num += lent_num;
+    if (kernel->swap != NULL) kernel->swap->reserved += swap_reserved(kernel);
+}
+
 /* This function will create a process with the user-specified virtual memory size,
  * the mapping to physical memory is not built up yet (PFN = -1, present = 0),
  * returns a >= 0 pid (index in MMStruct array) when succeeded, -1 when failed. */
@@ -8,7 +411,7 @@ int proc_create_vm(struct Kernel* kernel, int size) {
     if (0 >= size || size > VIRTUAL_SPACE_SIZE) return -1;
 
     int no_of_pages_needed = (size - 1) / PAGE_SIZE + 1;
-    if (kernel->allocated_pages + no_of_pages_needed > KERNEL_SPACE_SIZE / PAGE_SIZE) return -1;
+    if (!fits(kernel, no_of_pages_needed)) return -1;
 
     int pid = -1;
     for (int i = 0; i < MAX_PROCESS_NUM; ++i)
@@ -19,130 +422,1125 @@ int proc_create_vm(struct Kernel* kernel, int size) {
     if (pid == -1) return -1;
 
     // 2. Malloc page_table and update allocated_pages
-    kernel->allocated_pages += no_of_pages_needed;
+    reserve(kernel, no_of_pages_needed, 0);
     kernel->running[pid] = 1;
+    ++kernel->mm[pid].generation;
 
     kernel->mm[pid].size = size;
+    kernel->mm[pid].rt_pool = NULL;
+    kernel->mm[pid].rt_pool_num = 0;
+    kernel->mm[pid].hibernate_fd = -1;
+    kernel->mm[pid].reclaim_age = 0;
+    kernel->mm[pid].throttle = NULL;
+    kernel->mm[pid].prefetcher = NULL;
+    kernel->mm[pid].heap_spans = NULL;
     kernel->mm[pid].page_table = malloc(sizeof(struct PageTable));
     kernel->mm[pid].page_table->ptes = malloc(sizeof(struct PTE) * no_of_pages_needed);
+    kernel->mm[pid].page_table->refs = 1;
 
     // 3. The mapping to physical memory is not built up yet (PFN = -1, present = 0)
     for (int i = 0; i < no_of_pages_needed; ++i) {
         kernel->mm[pid].page_table->ptes[i].PFN = -1;
         kernel->mm[pid].page_table->ptes[i].present = 0;
+        kernel->mm[pid].page_table->ptes[i].foreign = 0;
+        kernel->mm[pid].page_table->ptes[i].swapped = 0;
+        kernel->mm[pid].page_table->ptes[i].accessed = 0;
+        kernel->mm[pid].page_table->ptes[i].idle_age = 0;
+        kernel->mm[pid].page_table->ptes[i].cold = 0;
+        kernel->mm[pid].page_table->ptes[i].zero = 0;
     }
 
     return pid;
 }
 
-/* This function will read the virtual memory segment [addr, addr + size) of a user-specified process to buf (buf shd be >= size),
- * if any page of the VM segment is not yet mapped to physical memory, this will map it first with first fit policy,
+/* This function will set a free frame aside for every page of a user-specified process (first fit),
+ * returns 0 when succeeded, -1 when failed (the frames set aside so far stay in the pool). */
+static int reserve_rt_pool(struct Kernel* kernel, int pid) {
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    kernel->mm[pid].rt_pool = malloc(sizeof(int) * no_of_pages);
+    for (int j = 0; j < KERNEL_SPACE_SIZE / PAGE_SIZE && kernel->mm[pid].rt_pool_num < no_of_pages; ++j)
+        if (!kernel->occupied_pages[j]) kernel->mm[pid].rt_pool[kernel->mm[pid].rt_pool_num++] = take_frame(kernel, j);
+    if (kernel->mm[pid].rt_pool_num < no_of_pages) return -1;
+
+    // Reverse the stack so that the faults take the lowest frames first, like first fit
+    for (int i = 0, j = no_of_pages - 1; i < j; ++i, --j) {
+        int pfn = kernel->mm[pid].rt_pool[i];
+        kernel->mm[pid].rt_pool[i] = kernel->mm[pid].rt_pool[j];
+        kernel->mm[pid].rt_pool[j] = pfn;
+    }
+    return 0;
+}
+
+/* This function will create a real-time process, like proc_create_vm but a frame is set aside for each of its pages now,
+ * so its faults never search for a free frame nor swap,
+ * returns a >= 0 pid when succeeded, -1 when failed (including not enough free frames). */
+int proc_create_vm_rt(struct Kernel* kernel, int size) {
+    int pid = proc_create_vm(kernel, size);
+    if (pid == -1) return -1;
+
+    if (reserve_rt_pool(kernel, pid) == -1) {
+        proc_exit_vm(kernel, pid);
+        return -1;
+    }
+    return pid;
+}
+
+struct CopyJob {
+    char** frames;     // Content of every page of the segment, resolved before the copy starts (NULL for a zero page).
+    long long addr;    // Virtual address of the segment.
+    int size;
+    char* buf;
+    int write;         // 0 -> kernel->space to buf, 1 -> buf to kernel->space.
+    CopyPageFn copy_page;
+    int first, last;   // The range of pages [first, last] (index into frames) this job copies.
+};
+
+static void* copy_pages(void* arg) {
+    struct CopyJob* job = arg;
+    long long start = job->addr / PAGE_SIZE;
+    for (int i = job->first; i <= job->last; ++i) {
+        long long lo = (start + i) * PAGE_SIZE, hi = lo + PAGE_SIZE;
+        if (lo < job->addr) lo = job->addr;
+        if (hi > job->addr + job->size) hi = job->addr + job->size;
+
+        char* user = job->buf + (lo - job->addr);
+        if (job->frames[i] == NULL) {
+            if (!job->write) memset(user, 0, hi - lo);
+            continue;
+        }
+        char* frame = job->frames[i] + lo % PAGE_SIZE;
+        if (hi - lo == PAGE_SIZE) job->write ? job->copy_page(frame, user) : job->copy_page(user, frame);
+        else if (job->write) memcpy(frame, user, hi - lo);
+        else memcpy(user, frame, hi - lo);
+    }
+    return NULL;
+}
+
+/* This function will copy the virtual memory segment [addr, addr + size) of a user-specified process from / to buf
+ * with PARALLEL_COPY_THREADS threads, every page (zero pages aside) is mapped up front so the threads only copy disjoint page ranges,
+ * returns 0 when succeeded, -1 when failed, -2 when the pages did not all fit in memory at once (nothing copied). */
+static int vm_copy_parallel(struct Kernel* kernel, int pid, char* addr, int size, char* buf, int write) {
+    int start = (long long) addr / PAGE_SIZE, end = ((long long) addr + size - 1) / PAGE_SIZE;
+    int no_of_pages = end - start + 1;
+    int no_of_threads = min(PARALLEL_COPY_THREADS, no_of_pages);
+
+    unsigned int epoch = kernel->map_epoch;
+    char** frames = malloc(sizeof(char*) * no_of_pages);
+    for (int i = 0; i < no_of_pages; ++i) {
+        long long lo = max((long long) (start + i) * PAGE_SIZE, (long long) addr);
+        long long hi = min((long long) (start + i + 1) * PAGE_SIZE, (long long) addr + size);
+        if (write && writes_zero_page(kernel, pid, start + i, lo, hi, buf + (lo - (long long) addr))) {
+            // Giving the page's own frame back moves nothing else
+            unsigned int before = kernel->map_epoch;
+            zero_page(kernel, pid, start + i);
+            epoch += kernel->map_epoch - before;
+            frames[i] = NULL;
+            continue;
+        }
+        // A zero page reads as zeros without taking a frame
+        if (!write && kernel->mm[pid].page_table->ptes[start + i].zero) {
+            frames[i] = NULL;
+            continue;
+        }
+
+        int pfn = map_page(kernel, pid, start + i);
+        if (pfn == -1) {
+            free(frames);
+            return -1;
+        }
+        frames[i] = frame_ptr(kernel, pfn, write);
+    }
+    // A page mapped earlier may have been swapped out to make room for a later one, copy page by page instead
+    if (kernel->map_epoch != epoch) {
+        free(frames);
+        return -2;
+    }
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * no_of_threads);
+    char* spawned = calloc(no_of_threads, sizeof(char));
+    struct CopyJob* jobs = malloc(sizeof(struct CopyJob) * no_of_threads);
+    for (int t = 0; t < no_of_threads; ++t)
+        jobs[t] = (struct CopyJob) {frames, (long long) addr, size, buf, write, kernel->copy_page,
+                                    (long long) no_of_pages * t / no_of_threads,
+                                    (long long) no_of_pages * (t + 1) / no_of_threads - 1};
+
+    // The calling thread takes the first range itself, and any range whose worker fails to spawn
+    for (int t = 1; t < no_of_threads; ++t)
+        spawned[t] = pthread_create(&threads[t], NULL, copy_pages, &jobs[t]) == 0;
+    for (int t = 0; t < no_of_threads; ++t)
+        if (!spawned[t]) copy_pages(&jobs[t]);
+    for (int t = 1; t < no_of_threads; ++t)
+        if (spawned[t]) pthread_join(threads[t], NULL);
+
+    free(spawned);
+    free(jobs);
+    free(threads);
+    free(frames);
+    return 0;
+}
+
+/* This function will wait until no other access of a user-specified process overlapping [lo, hi) is in progress
+ * (reads only conflict with writes), then hold the range. */
+static void range_lock(struct Kernel* kernel, int pid, long long lo, long long hi, int write) {
+    struct RangeLock* lock = &kernel->range_locks[pid];
+    pthread_mutex_lock(&lock->mutex);
+    for (int i = 0; i < lock->num; ++i)
+        if (lock->held[i].lo < hi && lo < lock->held[i].hi && (write || lock->held[i].write)) {
+            pthread_cond_wait(&lock->released, &lock->mutex);
+            i = -1;
+        }
+    if (lock->num == lock->cap) {
+        lock->cap = lock->cap > 0 ? lock->cap * 2 : 4;
+        lock->held = realloc(lock->held, sizeof(struct LockedRange) * lock->cap);
+    }
+    lock->held[lock->num++] = (struct LockedRange) {lo, hi, write};
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* This function will release a range held by range_lock and wake up the accesses waiting for it. */
+static void range_unlock(struct Kernel* kernel, int pid, long long lo, long long hi, int write) {
+    struct RangeLock* lock = &kernel->range_locks[pid];
+    pthread_mutex_lock(&lock->mutex);
+    for (int i = 0; i < lock->num; ++i)
+        if (lock->held[i].lo == lo && lock->held[i].hi == hi && lock->held[i].write == write) {
+            lock->held[i] = lock->held[--lock->num];
+            break;
+        }
+    pthread_cond_broadcast(&lock->released);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* This function will bring a user-specified process back into memory if it is hibernated,
  * returns 0 when succeeded, -1 when failed. */
-int vm_read(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
-    // 1. Check if the reading range is out-of-bounds
-    if (size <= 0) return -1;
-    if (0 > (long long) addr || (long long) addr >= kernel->mm[pid].size) return -1;
-    if ((long long) addr + size > kernel->mm[pid].size) return -1;
+static int make_resident(struct Kernel* kernel, int pid) {
+    if (kernel->mm[pid].hibernate_fd == -1) return 0;
+
+    pthread_rwlock_wrlock(&kernel->lock);
+    int failed = kernel->mm[pid].hibernate_fd != -1 && proc_resume_vm(kernel, pid) == -1;
+    pthread_rwlock_unlock(&kernel->lock);
+    return failed ? -1 : 0;
+}
+
+/* This function will resolve the frame behind a page of a user-specified process with kernel->lock held for reading,
+ * a fault (or the copy of a copy-on-write frame) takes the lock for writing meanwhile, then looks again since the page
+ * may be gone by the time the lock is back, a zero page being read resolves to NULL,
+ * returns 0 when succeeded, -1 when failed. */
+static int page_frame(struct Kernel* kernel, int pid, int page, int write, char** frame) {
+    for (;;) {
+        struct PTE* pte = &kernel->mm[pid].page_table->ptes[page];
+        if (pte->present && (!write || pte->foreign || kernel->cow == NULL || !kernel->cow[pte->PFN])) {
+            // Other readers may be setting it too, only the clock (holding the lock for writing) clears it
+            if (!__atomic_load_n(&pte->accessed, __ATOMIC_RELAXED)) __atomic_store_n(&pte->accessed, 1, __ATOMIC_RELAXED);
+            *frame = frame_ptr(kernel, pte->PFN, write);
+            return 0;
+        }
+        if (!write && pte->zero) {
+            *frame = NULL;
+            return 0;
+        }
+
+        pthread_rwlock_unlock(&kernel->lock);
+        pthread_rwlock_wrlock(&kernel->lock);
+        int pfn = map_page(kernel, pid, page);
+        if (pfn != -1) frame_ptr(kernel, pfn, write);
+        pthread_rwlock_unlock(&kernel->lock);
+        pthread_rwlock_rdlock(&kernel->lock);
+        if (pfn == -1) return -1;
+    }
+}
+
+static int read_pages(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
+    pthread_rwlock_rdlock(&kernel->lock);
 
     // 2. If any page of the VM segment is not yet mapped to physical memory, map it first with first fit policy
     int start = (long long) addr / PAGE_SIZE, start_offset = (long long) addr % PAGE_SIZE;
-    int end = ((long long) addr + size - 1) / PAGE_SIZE, end_offset = ((long long) addr + size) % PAGE_SIZE;
+    int end = ((long long) addr + size - 1) / PAGE_SIZE, end_offset = ((long long) addr + size - 1) % PAGE_SIZE + 1;
     for (int i = start, curr = 0; i <= end; ++i) {
-        if (!kernel->mm[pid].page_table->ptes[i].present) {
-            int pfn = -1;
-            for (int j = 0; j < KERNEL_SPACE_SIZE / PAGE_SIZE; ++j)
-                if (!kernel->occupied_pages[j]) {
-                    kernel->occupied_pages[j] = 1;
-                    pfn = j;
-                    break;
-                }
-            if (pfn == -1) return -1;
-
-            kernel->mm[pid].page_table->ptes[i].PFN = pfn;
-            kernel->mm[pid].page_table->ptes[i].present = 1;
+        // A zero page reads as zeros without taking a frame
+        char* frame;
+        if (page_frame(kernel, pid, i, 0, &frame) == -1) {
+            pthread_rwlock_unlock(&kernel->lock);
+            return -1;
         }
 
-        int pfn = kernel->mm[pid].page_table->ptes[i].PFN;
         // Single page read
-        if (start == end) memcpy(buf, kernel->space + PAGE_SIZE * pfn + start_offset, size);
+        if (start == end) copy_out(buf, frame, start_offset, size);
         // Multiple page read
         else if (i == start) {
-            memcpy(buf, kernel->space + PAGE_SIZE * pfn + start_offset, PAGE_SIZE - start_offset);
+            copy_out(buf, frame, start_offset, PAGE_SIZE - start_offset);
             curr += PAGE_SIZE - start_offset;
         }
-        else if (i == end) memcpy(buf + curr, kernel->space + PAGE_SIZE * pfn, end_offset);
+        else if (i == end) copy_out(buf + curr, frame, 0, end_offset);
         else {
-            memcpy(buf + curr, kernel->space + PAGE_SIZE * pfn, PAGE_SIZE);
+            if (frame == NULL) memset(buf + curr, 0, PAGE_SIZE);
+            else kernel->copy_page(buf + curr, frame);
             curr += PAGE_SIZE;
         }
     }
+    pthread_rwlock_unlock(&kernel->lock);
     return 0;
 }
 
-/* This function will write the virtual memory segment [addr, addr + size) of a user-specified process with buf (buf shd be >= size),
- * if any page of the VM segment is not yet mapped to physical memory, this will map it first with first fit policy,
- * returns 0 when succeeded, -1 when failed. */
-int vm_write(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
-    // 1. Check if the writing range is out-of-bounds
-    if (size <= 0) return -1;
-    if (0 > (long long) addr || (long long) addr >= kernel->mm[pid].size) return -1;
-    if ((long long) addr + size > kernel->mm[pid].size) return -1;
+static int write_pages(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
+    pthread_rwlock_rdlock(&kernel->lock);
 
     // 2. If any page of the VM segment is not yet mapped to physical memory, map it first with first fit policy
     int start = (long long) addr / PAGE_SIZE, start_offset = (long long) addr % PAGE_SIZE;
-    int end = ((long long) addr + size - 1) / PAGE_SIZE, end_offset = ((long long) addr + size) % PAGE_SIZE;
+    int end = ((long long) addr + size - 1) / PAGE_SIZE, end_offset = ((long long) addr + size - 1) % PAGE_SIZE + 1;
     for (int i = start, curr = 0; i <= end; ++i) {
-        if (!kernel->mm[pid].page_table->ptes[i].present) {
-            int pfn = -1;
-            for (int j = 0; j < KERNEL_SPACE_SIZE / PAGE_SIZE; ++j)
-                if (!kernel->occupied_pages[j]) {
-                    kernel->occupied_pages[j] = 1;
-                    pfn = j;
-                    break;
-                }
-            if (pfn == -1) return -1;
+        // A whole page of zeros goes to the zero state, giving its frame back
+        long long lo = i == start ? (long long) addr : (long long) i * PAGE_SIZE;
+        long long hi = i == end ? (long long) addr + size : (long long) (i + 1) * PAGE_SIZE;
+        if (writes_zero_page(kernel, pid, i, lo, hi, buf + (lo - (long long) addr))) {
+            if (!kernel->mm[pid].page_table->ptes[i].zero) {
+                pthread_rwlock_unlock(&kernel->lock);
+                pthread_rwlock_wrlock(&kernel->lock);
+                zero_page(kernel, pid, i);
+                pthread_rwlock_unlock(&kernel->lock);
+                pthread_rwlock_rdlock(&kernel->lock);
+            }
+            curr += hi - lo;
+            continue;
+        }
 
-            kernel->mm[pid].page_table->ptes[i].PFN = pfn;
-            kernel->mm[pid].page_table->ptes[i].present = 1;
+        char* frame;
+        if (page_frame(kernel, pid, i, 1, &frame) == -1) {
+            pthread_rwlock_unlock(&kernel->lock);
+            return -1;
         }
 
-        int pfn = kernel->mm[pid].page_table->ptes[i].PFN;
         // Single page write
-        if (start == end) memcpy(kernel->space + PAGE_SIZE * pfn + start_offset, buf, size);
+        if (start == end) memcpy(frame + start_offset, buf, size);
         // Multiple page write
         else if (i == start) {
-            memcpy(kernel->space + PAGE_SIZE * pfn + start_offset, buf, PAGE_SIZE - start_offset);
+            memcpy(frame + start_offset, buf, PAGE_SIZE - start_offset);
             curr += PAGE_SIZE - start_offset;
         }
-        else if (i == end) memcpy(kernel->space + PAGE_SIZE * pfn, buf + curr, end_offset);
+        else if (i == end) memcpy(frame, buf + curr, end_offset);
         else {
-            memcpy(kernel->space + PAGE_SIZE * pfn, buf + curr, PAGE_SIZE);
+            kernel->copy_page(frame, buf + curr);
             curr += PAGE_SIZE;
         }
     }
+    pthread_rwlock_unlock(&kernel->lock);
     return 0;
 }
 
+/* This function will read the virtual memory segment [addr, addr + size) of a user-specified process to buf (buf shd be >= size),
+ * if any page of the VM segment is not yet mapped to physical memory, this will map it first with first fit policy,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_read(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
+    // 1. Check if the reading range is out-of-bounds
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (size <= 0) return -1;
+    if (0 > (long long) addr || (long long) addr >= kernel->mm[pid].size) return -1;
+    if ((long long) addr + size > kernel->mm[pid].size) return -1;
+    if (make_resident(kernel, pid) == -1) return -1;
+
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, size, 0));
+
+    // Overlapping accesses of the process wait for each other, disjoint ones go on in parallel
+    range_lock(kernel, pid, (long long) addr, (long long) addr + size, 0);
+    int ret = -2;
+    // Big transfers are split by page ranges across worker threads
+    if (PARALLEL_COPY_THRESHOLD > 0 && PARALLEL_COPY_THREADS > 1 && size >= PARALLEL_COPY_THRESHOLD) {
+        pthread_rwlock_wrlock(&kernel->lock);
+        ret = vm_copy_parallel(kernel, pid, addr, size, buf, 0);
+        pthread_rwlock_unlock(&kernel->lock);
+    }
+    if (ret == -2) ret = read_pages(kernel, pid, addr, size, buf);
+    range_unlock(kernel, pid, (long long) addr, (long long) addr + size, 0);
+    // The faults of this call are paid for now
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, 0, 0));
+    return ret;
+}
+
+/* This function will write the virtual memory segment [addr, addr + size) of a user-specified process with buf (buf shd be >= size),
+ * if any page of the VM segment is not yet mapped to physical memory, this will map it first with first fit policy,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_write(struct Kernel* kernel, int pid, char* addr, int size, char* buf) {
+    // 1. Check if the writing range is out-of-bounds
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (size <= 0) return -1;
+    if (0 > (long long) addr || (long long) addr >= kernel->mm[pid].size) return -1;
+    if ((long long) addr + size > kernel->mm[pid].size) return -1;
+    if (make_resident(kernel, pid) == -1) return -1;
+
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, size, 0));
+
+    // Overlapping accesses of the process wait for each other, disjoint ones go on in parallel
+    range_lock(kernel, pid, (long long) addr, (long long) addr + size, 1);
+    int ret = -2;
+    // Big transfers are split by page ranges across worker threads
+    if (PARALLEL_COPY_THRESHOLD > 0 && PARALLEL_COPY_THREADS > 1 && size >= PARALLEL_COPY_THRESHOLD) {
+        pthread_rwlock_wrlock(&kernel->lock);
+        ret = vm_copy_parallel(kernel, pid, addr, size, buf, 1);
+        pthread_rwlock_unlock(&kernel->lock);
+    }
+    if (ret == -2) ret = write_pages(kernel, pid, addr, size, buf);
+    range_unlock(kernel, pid, (long long) addr, (long long) addr + size, 1);
+    // The faults of this call are paid for now
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, 0, 0));
+    return ret;
+}
+
+/* This function will copy count elements of elem_size bytes, stride bytes apart from base, from / to buf (packed),
+ * resolving every page once however many elements it holds, with kernel->lock held for reading,
+ * returns 0 when succeeded, -1 when failed. */
+static int copy_strided(struct Kernel* kernel, int pid, long long base, int elem_size, int stride, int count, char* buf, int write) {
+    pthread_rwlock_rdlock(&kernel->lock);
+    int page = -1;
+    char* frame = NULL;
+    for (int e = 0; e < count; ++e) {
+        long long addr = base + (long long) e * stride;
+        char* user = buf + (long long) e * elem_size;
+        // An element may straddle pages, the addresses only go up so a page once left is never needed again
+        for (int done = 0; done < elem_size;) {
+            int p = (addr + done) / PAGE_SIZE, offset = (addr + done) % PAGE_SIZE, len = min(elem_size - done, PAGE_SIZE - offset);
+            if (p != page) {
+                if (page_frame(kernel, pid, p, write, &frame) == -1) {
+                    pthread_rwlock_unlock(&kernel->lock);
+                    return -1;
+                }
+                page = p;
+            }
+            if (write) memcpy(frame + offset, user + done, len);
+            else copy_out(user + done, frame, offset, len);
+            done += len;
+        }
+    }
+    pthread_rwlock_unlock(&kernel->lock);
+    return 0;
+}
+
+/* This function will gather (write = 0) or scatter (write = 1) count elements of a user-specified process,
+ * the whole access is checked before any element is copied,
+ * returns 0 when succeeded, -1 when failed. */
+static int vm_copy_strided(struct Kernel* kernel, int pid, char* base, int elem_size, int stride, int count, char* buf, int write) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || buf == NULL) return -1;
+    if (elem_size <= 0 || count <= 0 || stride < elem_size) return -1;
+    long long end = (long long) base + (long long) (count - 1) * stride + elem_size;
+    if (0 > (long long) base || end > kernel->mm[pid].size) return -1;
+    if (make_resident(kernel, pid) == -1) return -1;
+
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, (long long) elem_size * count, 0));
+
+    range_lock(kernel, pid, (long long) base, end, write);
+    int ret = copy_strided(kernel, pid, (long long) base, elem_size, stride, count, buf, write);
+    range_unlock(kernel, pid, (long long) base, end, write);
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, 0, 0));
+    return ret;
+}
+
+int vm_read_strided(struct Kernel* kernel, int pid, char* base, int elem_size, int stride, int count, char* buf) {
+    return vm_copy_strided(kernel, pid, base, elem_size, stride, count, buf, 0);
+}
+
+int vm_write_strided(struct Kernel* kernel, int pid, char* base, int elem_size, int stride, int count, char* buf) {
+    return vm_copy_strided(kernel, pid, base, elem_size, stride, count, buf, 1);
+}
+
+/* This function will tell if an access of a batch is within a running, resident process. */
+static int access_ok(struct Kernel* kernel, struct VMAccess* access) {
+    int pid = access->pid;
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || kernel->mm[pid].hibernate_fd != -1) return 0;
+    return access->size > 0 && 0 <= (long long) access->addr && (long long) access->addr + access->size <= kernel->mm[pid].size;
+}
+
+/* This function will copy an access of a batch page by page, with kernel->lock held for writing,
+ * returns 0 when succeeded, -1 when failed. */
+static int copy_access(struct Kernel* kernel, struct VMAccess* access, int write) {
+    long long addr = (long long) access->addr;
+    for (int done = 0; done < access->size;) {
+        int page = (addr + done) / PAGE_SIZE, offset = (addr + done) % PAGE_SIZE, len = min(access->size - done, PAGE_SIZE - offset);
+        if (write && writes_zero_page(kernel, access->pid, page, addr + done, addr + done + len, access->buf + done)) {
+            zero_page(kernel, access->pid, page);
+            done += len;
+            continue;
+        }
+        int pfn = map_page(kernel, access->pid, page);
+        if (pfn == -1) return -1;
+        if (write) memcpy(frame_ptr(kernel, pfn, 1) + offset, access->buf + done, len);
+        else memcpy(access->buf + done, frame_ptr(kernel, pfn, 0) + offset, len);
+        done += len;
+    }
+    return 0;
+}
+
+/* This function will run a batch of accesses as a pipeline: the PTE of the access BATCH_PREFETCH_DISTANCE ahead is
+ * prefetched, the frame of the one half as far ahead (its PTE has arrived by then) too, and the current one is copied,
+ * returns the number of accesses done (stopping at the first failing one). */
+static int vm_copy_batch(struct Kernel* kernel, struct VMAccess* accesses, int n, int write) {
+    if (accesses == NULL || n <= 0) return 0;
+
+    // Throttling may sleep, so it happens before anything is locked
+    for (int i = 0; i < n; ++i) {
+        int pid = accesses[i].pid;
+        if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) continue;
+        struct Throttle* throttle = kernel->mm[pid].throttle;
+        if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, accesses[i].size, 0));
+    }
+
+    // The span of every process is held against vm_read/vm_write (which fault without the kernel lock),
+    // in pid order so that two batches cannot wait for each other
+    long long* lo = malloc(sizeof(long long) * MAX_PROCESS_NUM * 2), * hi = lo + MAX_PROCESS_NUM;
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid) lo[pid] = hi[pid] = 0;
+    for (int i = 0; i < n; ++i) {
+        int pid = accesses[i].pid;
+        if (0 > pid || pid >= MAX_PROCESS_NUM || accesses[i].size <= 0) continue;
+        long long start = (long long) accesses[i].addr, end = start + accesses[i].size;
+        int first = lo[pid] == hi[pid];
+        lo[pid] = first ? start : min(lo[pid], start);
+        hi[pid] = first ? end : max(hi[pid], end);
+    }
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid)
+        if (lo[pid] < hi[pid]) range_lock(kernel, pid, lo[pid], hi[pid], write);
+
+    pthread_rwlock_wrlock(&kernel->lock);
+    int done = 0, far = BATCH_PREFETCH_DISTANCE, near = BATCH_PREFETCH_DISTANCE / 2;
+    for (; done < n; ++done) {
+        if (done + far < n && access_ok(kernel, &accesses[done + far])) {
+            struct VMAccess* ahead = &accesses[done + far];
+            __builtin_prefetch(&kernel->mm[ahead->pid].page_table->ptes[(long long) ahead->addr / PAGE_SIZE]);
+        }
+        if (done + near < n && access_ok(kernel, &accesses[done + near])) {
+            struct VMAccess* ahead = &accesses[done + near];
+            struct PTE* pte = &kernel->mm[ahead->pid].page_table->ptes[(long long) ahead->addr / PAGE_SIZE];
+            if (pte->present) __builtin_prefetch(frame_ptr(kernel, pte->PFN, 0) + (long long) ahead->addr % PAGE_SIZE);
+        }
+
+        // A hibernated process is resumed when its first access comes, so that the count stays true
+        struct VMAccess* access = &accesses[done];
+        int pid = access->pid;
+        if (0 <= pid && pid < MAX_PROCESS_NUM && kernel->running[pid] && kernel->mm[pid].hibernate_fd != -1
+            && proc_resume_vm(kernel, pid) == -1) break;
+        if (!access_ok(kernel, access) || copy_access(kernel, access, write) == -1) break;
+    }
+    pthread_rwlock_unlock(&kernel->lock);
+
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid)
+        if (lo[pid] < hi[pid]) range_unlock(kernel, pid, lo[pid], hi[pid], write);
+    free(lo);
+
+    for (int i = 0; i < n; ++i) {
+        int pid = accesses[i].pid;
+        if (0 <= pid && pid < MAX_PROCESS_NUM && kernel->running[pid] && kernel->mm[pid].throttle != NULL)
+            throttle_wait(kernel->mm[pid].throttle, throttle_charge(kernel->mm[pid].throttle, 0, 0));
+    }
+    return done;
+}
+
+int vm_read_batch(struct Kernel* kernel, struct VMAccess* accesses, int n) {
+    return vm_copy_batch(kernel, accesses, n, 0);
+}
+
+int vm_write_batch(struct Kernel* kernel, struct VMAccess* accesses, int n) {
+    return vm_copy_batch(kernel, accesses, n, 1);
+}
+
 /* This function will destroy a user-specified process,
  * returns 0 when succeeded, -1 when failed. */
 int proc_exit_vm(struct Kernel* kernel, int pid) {
-    if (!kernel->running[pid]) return -1;
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
 
-    // 1. Unset the corresponding pages in occupied_pages
+    // 1. Unset the corresponding pages in occupied_pages (a hibernated process holds neither frames nor reservation)
     int no_of_pages_allocated = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
-    for (int i = 0; i < no_of_pages_allocated; ++i)
-        if (kernel->mm[pid].page_table->ptes[i].present)
-            kernel->occupied_pages[kernel->mm[pid].page_table->ptes[i].PFN] = 0;
+    if (kernel->mm[pid].hibernate_fd != -1) {
+        close(kernel->mm[pid].hibernate_fd);
+        kernel->mm[pid].hibernate_fd = -1;
+    }
+    else {
+        // 2. Be a responsible system programmer (the page table may still be shared with a clone)
+        release_page_table(kernel, pid);
+        reserve(kernel, -no_of_pages_allocated, 0);
+    }
     kernel->mm[pid].size = 0;
-    kernel->allocated_pages -= no_of_pages_allocated;
-
-    // 2. Be a responsible system programmer
-    free(kernel->mm[pid].page_table->ptes);
-    free(kernel->mm[pid].page_table);
-    kernel->mm[pid].page_table = NULL;
+    throttle_release(kernel->mm[pid].throttle);
+    kernel->mm[pid].throttle = NULL;
+    free(kernel->mm[pid].prefetcher);
+    kernel->mm[pid].prefetcher = NULL;
+    free(kernel->mm[pid].heap_spans);
+    kernel->mm[pid].heap_spans = NULL;
 
     // Bye.
     kernel->running[pid] = 0;
+    ++kernel->mm[pid].generation;
+    ++kernel->map_epoch;
+
+    return 0;
+}
+
+/* This function will translate the word at addr of a user-specified process to its kernel-managed memory,
+ * mapping the page first with first fit policy if needed, with kernel->lock held for reading when succeeded
+ * (the caller releases it once the word is updated),
+ * returns the word's address in kernel->space when succeeded, NULL when failed (bad pid, out of bounds, misaligned). */
+static int64_t* translate_word(struct Kernel* kernel, int pid, char* addr) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return NULL;
+    if (0 > (long long) addr || (long long) addr + (long long) sizeof(int64_t) > kernel->mm[pid].size) return NULL;
+    if ((long long) addr % sizeof(int64_t)) return NULL;
+    if (make_resident(kernel, pid) == -1) return NULL;
+
+    // The word shd not straddle two pages, or the two halves may live in unrelated frames
+    int page = (long long) addr / PAGE_SIZE;
+    if (((long long) addr + (long long) sizeof(int64_t) - 1) / PAGE_SIZE != page) return NULL;
+
+    // The frame must not be evicted or recycled under the atomic, which runs before the lock is released
+    pthread_rwlock_rdlock(&kernel->lock);
+    char* frame;
+    if (page_frame(kernel, pid, page, 1, &frame) == -1) {
+        pthread_rwlock_unlock(&kernel->lock);
+        return NULL;
+    }
+
+    char* word = frame + (long long) addr % PAGE_SIZE;
+    if ((uintptr_t) word % sizeof(int64_t)) {
+        pthread_rwlock_unlock(&kernel->lock);
+        return NULL;
+    }
+    return (int64_t*) word;
+}
+
+/* This function will atomically replace the word at addr of a user-specified process with desired if it equals expected,
+ * the previous value is stored to *old (the swap happened iff *old == expected),
+ * returns 0 when succeeded, -1 when failed. */
+int vm_cas(struct Kernel* kernel, int pid, char* addr, int64_t expected, int64_t desired, int64_t* old) {
+    int64_t* word = translate_word(kernel, pid, addr);
+    if (word == NULL) return -1;
+
+    __atomic_compare_exchange_n(word, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    *old = expected;
+    pthread_rwlock_unlock(&kernel->lock);
+    return 0;
+}
+
+/* This function will atomically add val to the word at addr of a user-specified process,
+ * the previous value is stored to *old,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_fetch_add(struct Kernel* kernel, int pid, char* addr, int64_t val, int64_t* old) {
+    int64_t* word = translate_word(kernel, pid, addr);
+    if (word == NULL) return -1;
+
+    *old = __atomic_fetch_add(word, val, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&kernel->lock);
+    return 0;
+}
+
+/* This function will atomically store val to the word at addr of a user-specified process,
+ * the previous value is stored to *old,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_exchange(struct Kernel* kernel, int pid, char* addr, int64_t val, int64_t* old) {
+    int64_t* word = translate_word(kernel, pid, addr);
+    if (word == NULL) return -1;
+
+    *old = __atomic_exchange_n(word, val, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&kernel->lock);
+    return 0;
+}
+
+/* This function will release the frames behind every whole page inside [addr, addr + size) of a user-specified process,
+ * the pages become not present and are mapped again on their next access,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_punch_hole(struct Kernel* kernel, int pid, char* addr, int size) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (size < 0 || 0 > (long long) addr || (long long) addr + size > kernel->mm[pid].size) return -1;
+    if (kernel->mm[pid].hibernate_fd != -1 && proc_resume_vm(kernel, pid) == -1) return -1;
+
+    // Only the pages fully covered by the range, a partially covered page still holds live bytes
+    long long first = ((long long) addr + PAGE_SIZE - 1) / PAGE_SIZE, last = ((long long) addr + size) / PAGE_SIZE - 1;
+    // The last page of a process may be shorter than PAGE_SIZE
+    if ((long long) addr + size == kernel->mm[pid].size) last = (kernel->mm[pid].size - 1) / PAGE_SIZE;
+    for (long long i = first; i <= last; ++i) {
+        if (!kernel->mm[pid].page_table->ptes[i].present && !kernel->mm[pid].page_table->ptes[i].swapped) continue;
+
+        struct PTE* pte = &unshare_page_table(kernel, pid)->ptes[i];
+        release_page(kernel, pid, pte);
+        pte->PFN = -1;
+        pte->present = 0;
+        pte->foreign = 0;
+        pte->swapped = 0;
+        pte->zero = 0;
+        ++kernel->map_epoch;
+    }
+    return 0;
+}
+
+struct ProcHandle {
+    struct Kernel* kernel;
+    int pid;
+    int generation;          // mm->generation when opened, a mismatch means the process has exited.
+    struct MMStruct* mm;
+    struct PTE* ptes;        // The page table base, valid while epoch == kernel->map_epoch.
+    unsigned int epoch;
+    int hint_page, hint_pfn; // The last translation, valid while epoch == kernel->map_epoch.
+};
+
+/* This function will open a handle on a running process,
+ * returns the handle when succeeded, NULL when failed. */
+struct ProcHandle* proc_open(struct Kernel* kernel, int pid) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return NULL;
+
+    struct ProcHandle* handle = malloc(sizeof(struct ProcHandle));
+    handle->kernel = kernel;
+    handle->pid = pid;
+    handle->generation = kernel->mm[pid].generation;
+    handle->mm = &kernel->mm[pid];
+    // The translation state is picked up by the first access (the process may be hibernated)
+    handle->ptes = NULL;
+    handle->epoch = kernel->map_epoch - 1;
+    handle->hint_page = -1;
+    return handle;
+}
+
+void proc_close(struct ProcHandle* handle) {
+    free(handle);
+}
+
+/* This function will copy [addr, addr + size) of the process behind a handle from / to buf,
+ * an access inside one page goes through the cached translation, others fall back to vm_read/vm_write,
+ * returns 0 when succeeded, -1 when failed. */
+static int vm_copy_handle(struct ProcHandle* handle, char* addr, int size, char* buf, int write) {
+    struct Kernel* kernel = handle->kernel;
+    if (handle->mm->generation != handle->generation) return -1;
+
+    int page = (long long) addr / PAGE_SIZE, offset = (long long) addr % PAGE_SIZE;
+    if (size <= 0 || 0 > (long long) addr || (long long) addr + size > handle->mm->size || offset + size > PAGE_SIZE)
+        return write ? vm_write(kernel, handle->pid, addr, size, buf) : vm_read(kernel, handle->pid, addr, size, buf);
+    if (make_resident(kernel, handle->pid) == -1) return -1;
+
+    struct Throttle* throttle = handle->mm->throttle;
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, size, 0));
+
+    // The same locking as vm_read/vm_write: the range against overlapping accesses, the kernel against evictions
+    long long lo = (long long) addr, hi = lo + size;
+    range_lock(kernel, handle->pid, lo, hi, write);
+    pthread_rwlock_rdlock(&kernel->lock);
+    if (handle->epoch != kernel->map_epoch) {
+        handle->ptes = handle->mm->page_table->ptes;
+        handle->epoch = kernel->map_epoch;
+        handle->hint_page = -1;
+    }
+
+    char* frame;
+    if (page == handle->hint_page && (!write || kernel->cow == NULL || !kernel->cow[handle->hint_pfn])) {
+        struct PTE* pte = &handle->ptes[page];
+        if (!__atomic_load_n(&pte->accessed, __ATOMIC_RELAXED)) __atomic_store_n(&pte->accessed, 1, __ATOMIC_RELAXED);
+        frame = frame_ptr(kernel, handle->hint_pfn, write);
+    }
+    else {
+        if (page_frame(kernel, handle->pid, page, write, &frame) == -1) {
+            pthread_rwlock_unlock(&kernel->lock);
+            range_unlock(kernel, handle->pid, lo, hi, write);
+            if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, 0, 0));
+            return -1;
+        }
+        // A fault may have unshared the page table with the lock released, so re-derive everything
+        handle->ptes = handle->mm->page_table->ptes;
+        handle->epoch = kernel->map_epoch;
+        handle->hint_page = handle->ptes[page].present ? page : -1;
+        handle->hint_pfn = handle->ptes[page].PFN;
+    }
+
+    if (write) memcpy(frame + offset, buf, size);
+    else copy_out(buf, frame, offset, size);
+    pthread_rwlock_unlock(&kernel->lock);
+    range_unlock(kernel, handle->pid, lo, hi, write);
+    // The fault of this call, if any, is paid for now
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, 0, 0));
+    return 0;
+}
+
+int vm_read_handle(struct ProcHandle* handle, char* addr, int size, char* buf) {
+    return vm_copy_handle(handle, addr, size, buf, 0);
+}
+
+int vm_write_handle(struct ProcHandle* handle, char* addr, int size, char* buf) {
+    return vm_copy_handle(handle, addr, size, buf, 1);
+}
+
+/* This function will map [addr, addr + len) of a user-specified process onto caller-owned host memory without copying,
+ * the previous content of those pages is dropped and their frames are released,
+ * returns 0 when succeeded, -1 when failed. */
+int vm_attach_host_memory(struct Kernel* kernel, int pid, char* addr, char* host_ptr, int len) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (host_ptr == NULL || len <= 0 || 0 > (long long) addr || (long long) addr + len > kernel->mm[pid].size) return -1;
+    if ((long long) addr % PAGE_SIZE || (uintptr_t) host_ptr % PAGE_SIZE) return -1;
+    if (len % PAGE_SIZE && (long long) addr + len != kernel->mm[pid].size) return -1;
+    if (kernel->mm[pid].hibernate_fd != -1 && proc_resume_vm(kernel, pid) == -1) return -1;
+
+    int first = (long long) addr / PAGE_SIZE, no_of_pages = (len - 1) / PAGE_SIZE + 1;
+    int needed = no_of_pages - kernel->foreign_free_num;
+    if (needed > 0) {
+        kernel->foreign_frames = realloc(kernel->foreign_frames, sizeof(char*) * (kernel->foreign_num + needed));
+        kernel->foreign_free = realloc(kernel->foreign_free, sizeof(int) * (kernel->foreign_num + needed));
+        for (int i = 0; i < needed; ++i)
+            kernel->foreign_free[kernel->foreign_free_num++] = kernel->foreign_num++;
+    }
+
+    struct PageTable* page_table = unshare_page_table(kernel, pid);
+    for (int i = 0; i < no_of_pages; ++i) {
+        struct PTE* pte = &page_table->ptes[first + i];
+        if (pte->present || pte->swapped) release_page(kernel, pid, pte);
+
+        int slot = kernel->foreign_free[--kernel->foreign_free_num];
+        kernel->foreign_frames[slot] = host_ptr + (long long) PAGE_SIZE * i;
+        pte->PFN = KERNEL_SPACE_SIZE / PAGE_SIZE + slot;
+        pte->present = 1;
+        pte->foreign = 1;
+        pte->swapped = 0;
+        pte->zero = 0;
+        pte->cold = 0;
+    }
+    ++kernel->map_epoch;
+    return 0;
+}
+
+/* This function will hand the host memory behind the frames free since the previous run back to the OS,
+ * returns the number of bytes released. */
+long long kernel_report_free_pages(struct Kernel* kernel) {
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    long long host_page = sysconf(_SC_PAGESIZE), released = 0;
+    kernel->freed_since_report = 0;
+
+    // Age the free frames, a frame seen free twice in a row is long-free
+    for (int j = 0; j < frames; ++j)
+        if (kernel->occupied_pages[j]) kernel->free_seen[j] = 0;
+        else if (!kernel->free_seen[j]) kernel->free_seen[j] = 2;
+
+    // Release the runs of host pages whose frames are all long-free and not all reported yet
+    long long host_pages = KERNEL_SPACE_SIZE / host_page, run = -1;
+    for (long long page = 0; page <= host_pages; ++page) {
+        int take = page < host_pages, fresh = 0;
+        for (long long j = page * host_page / PAGE_SIZE; take && j * PAGE_SIZE < (page + 1) * host_page; ++j) {
+            if (j >= frames || kernel->occupied_pages[j] || kernel->free_seen[j] != 1) take = 0;
+            else fresh |= !kernel->reported[j];
+        }
+        if (take && fresh) {
+            if (run == -1) run = page;
+            continue;
+        }
+
+        // kernel->space is host page aligned (see init_kernel)
+        if (run != -1 && madvise(kernel->space + run * host_page, (page - run) * host_page, MADV_DONTNEED) == 0) {
+            // Only the frames lying entirely in the run read as zeros now
+            for (long long j = (run * host_page + PAGE_SIZE - 1) / PAGE_SIZE; (j + 1) * PAGE_SIZE <= page * host_page; ++j)
+                kernel->reported[j] = 1;
+            released += (page - run) * host_page;
+        }
+        run = -1;
+    }
+
+    for (int j = 0; j < frames; ++j)
+        if (kernel->free_seen[j] == 2) kernel->free_seen[j] = 1;
+    return released;
+}
+
+/* Hibernation image layout (the file is unlinked right away, only its descriptor is kept):
+ *   struct HibernateHeader
+ *   the state of every page (HIBERNATE_*), one char each
+ *   the host address of every HIBERNATE_FOREIGN page, in page order
+ *   the content of every HIBERNATE_DATA page, in page order */
+#define HIBERNATE_UNTOUCHED 0
+#define HIBERNATE_DATA 1
+#define HIBERNATE_FOREIGN 2
+#define HIBERNATE_ZERO 3
+
+struct HibernateHeader {
+    int size;
+    int rt;           // 1 if the process was created by proc_create_vm_rt.
+    int data_pages;
+    int foreign_pages;
+};
+
+/* This function will write the pages and page table of a user-specified process to a file and release all its frames,
+ * returns 0 when succeeded, -1 when failed (the process is left as it was). */
+int proc_hibernate_vm(struct Kernel* kernel, int pid, const char* path) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || kernel->mm[pid].hibernate_fd != -1) return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return -1;
+    unlink(path);
+    FILE* file = fdopen(dup(fd), "wb");
+    if (file == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    struct PTE* ptes = kernel->mm[pid].page_table->ptes;
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    struct HibernateHeader header = {kernel->mm[pid].size, kernel->mm[pid].rt_pool != NULL, 0, 0};
+    char* states = malloc(no_of_pages);
+    for (int i = 0; i < no_of_pages; ++i) {
+        states[i] = ptes[i].foreign ? HIBERNATE_FOREIGN : ptes[i].present || ptes[i].swapped ? HIBERNATE_DATA
+                    : ptes[i].zero ? HIBERNATE_ZERO : HIBERNATE_UNTOUCHED;
+        header.data_pages += states[i] == HIBERNATE_DATA;
+        header.foreign_pages += states[i] == HIBERNATE_FOREIGN;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(states, 1, no_of_pages, file) != (size_t) no_of_pages;
+    for (int i = 0; i < no_of_pages && !failed; ++i)
+        if (states[i] == HIBERNATE_FOREIGN)
+            failed = fwrite(&kernel->foreign_frames[ptes[i].PFN - KERNEL_SPACE_SIZE / PAGE_SIZE], sizeof(char*), 1, file) != 1;
+    // Swapped out pages are pulled into the image too, so that it does not depend on the swap devices
+    char* page = malloc(PAGE_SIZE);
+    for (int i = 0; i < no_of_pages && !failed; ++i) {
+        if (states[i] != HIBERNATE_DATA) continue;
+        char* content = page;
+        if (ptes[i].present) content = frame_ptr(kernel, ptes[i].PFN, 0);
+        else failed = swap_read_page(kernel->swap, ptes[i].PFN, page) == -1;
+        failed = failed || fwrite(content, 1, PAGE_SIZE, file) != (size_t) PAGE_SIZE;
+    }
+    free(page);
+    free(states);
+    failed = fclose(file) || failed;
+    if (failed) {
+        close(fd);
+        return -1;
+    }
+
+    // Leave a stub: the process keeps running but holds neither frames nor reservation
+    release_page_table(kernel, pid);
+    reserve(kernel, -no_of_pages, 0);
+    kernel->mm[pid].hibernate_fd = fd;
+    return 0;
+}
+
+/* This function will bring a hibernated process back into memory, reserving its pages again,
+ * returns 0 when succeeded (or the process was not hibernated), -1 when failed (it then stays hibernated). */
+int proc_resume_vm(struct Kernel* kernel, int pid) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    int fd = kernel->mm[pid].hibernate_fd;
+    if (fd == -1) return 0;
+
+    int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    if (!fits(kernel, no_of_pages)) return -1;
+
+    struct HibernateHeader header;
+    char* states = malloc(no_of_pages);
+    char** foreign = NULL;
+    off_t offset = sizeof(header) + no_of_pages;
+    int failed = pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.size != kernel->mm[pid].size
+                 || pread(fd, states, no_of_pages, sizeof(header)) != no_of_pages;
+    if (!failed) {
+        foreign = malloc(sizeof(char*) * (header.foreign_pages + 1));
+        ssize_t len = sizeof(char*) * header.foreign_pages;
+        failed = pread(fd, foreign, len, offset) != len;
+        offset += len;
+    }
+    if (failed) {
+        free(states);
+        free(foreign);
+        return -1;
+    }
 
+    // Rebuild an untouched page table, then fault every page with content back in
+    kernel->mm[pid].page_table = malloc(sizeof(struct PageTable));
+    kernel->mm[pid].page_table->ptes = calloc(no_of_pages, sizeof(struct PTE));
+    kernel->mm[pid].page_table->refs = 1;
+    for (int i = 0; i < no_of_pages; ++i) kernel->mm[pid].page_table->ptes[i].PFN = -1;
+    kernel->mm[pid].hibernate_fd = -1;
+    reserve(kernel, no_of_pages, 0);
+    ++kernel->map_epoch;
+
+    failed = header.rt && reserve_rt_pool(kernel, pid) == -1;
+    for (int i = 0, f = 0; i < no_of_pages && !failed; ++i) {
+        if (states[i] == HIBERNATE_FOREIGN) {
+            int len = min(PAGE_SIZE, kernel->mm[pid].size - i * PAGE_SIZE);
+            failed = vm_attach_host_memory(kernel, pid, (char*) ((long long) i * PAGE_SIZE), foreign[f++], len) == -1;
+        }
+        else if (states[i] == HIBERNATE_ZERO) {
+            // Fault-around from a data page before it may have mapped it to a frame with leftover content
+            struct PTE* pte = &kernel->mm[pid].page_table->ptes[i];
+            if (pte->present) {
+                release_page(kernel, pid, pte);
+                pte->PFN = -1;
+                pte->present = 0;
+            }
+            pte->zero = 1;
+        }
+        else if (states[i] == HIBERNATE_DATA) {
+            int pfn = map_page(kernel, pid, i);
+            failed = pfn == -1 || pread(fd, frame_ptr(kernel, pfn, 1), PAGE_SIZE, offset) != PAGE_SIZE;
+            offset += PAGE_SIZE;
+        }
+    }
+    free(states);
+    free(foreign);
+
+    if (failed) {
+        release_page_table(kernel, pid);
+        reserve(kernel, -no_of_pages, 0);
+        kernel->mm[pid].hibernate_fd = fd;
+        return -1;
+    }
+    close(fd);
     return 0;
 }
+
+/* This function will age every present page, a page accessed since the last scan is young again,
+ * returns the number of pages scanned. */
+int kernel_scan_idle(struct Kernel* kernel) {
+    int scanned = 0;
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid) {
+        if (!kernel->running[pid] || kernel->mm[pid].hibernate_fd != -1) continue;
+
+        struct PTE* ptes = kernel->mm[pid].page_table->ptes;
+        int no_of_pages = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+        for (int i = 0; i < no_of_pages; ++i) {
+            if (!ptes[i].present || ptes[i].foreign) continue;
+            if (ptes[i].accessed) {
+                ptes[i].accessed = 0;
+                ptes[i].idle_age = 0;
+            }
+            else if (ptes[i].idle_age < 255) ++ptes[i].idle_age;
+            ++scanned;
+        }
+    }
+    return scanned;
+}
+
+/* This function will set the idle age (in kernel_scan_idle periods) past which the pages of a process are reclaimed,
+ * returns 0 when succeeded, -1 when failed. */
+int proc_set_reclaim_age(struct Kernel* kernel, int pid, int age) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || 0 > age || age > 255) return -1;
+    kernel->mm[pid].reclaim_age = age;
+    return 0;
+}
+
+/* This function will swap out at most max_pages pages idle for at least the reclaim age of their process,
+ * picking up where the previous call stopped so that every process gets its turn,
+ * returns the number of pages reclaimed. */
+int kernel_reclaim_cold(struct Kernel* kernel, int max_pages) {
+    if (kernel->swap == NULL) return 0;
+
+    int reclaimed = 0;
+    for (int round = 0; round <= MAX_PROCESS_NUM && reclaimed < max_pages; ++round) {
+        int pid = kernel->reclaim_pid;
+        struct MMStruct* mm = &kernel->mm[pid];
+        if (kernel->running[pid] && mm->reclaim_age > 0 && mm->rt_pool == NULL && mm->hibernate_fd == -1) {
+            int no_of_pages = (mm->size - 1) / PAGE_SIZE + 1;
+            for (; kernel->reclaim_page < no_of_pages && reclaimed < max_pages; ++kernel->reclaim_page) {
+                struct PTE* pte = &mm->page_table->ptes[kernel->reclaim_page];
+                if (!pte->present || pte->foreign || pte->accessed || pte->idle_age < mm->reclaim_age) continue;
+
+                // Only into the slots no other kernel sharing the area counts on
+                if (swap_used_slots(kernel->swap) >= kernel->swap->total_slots - (kernel->swap->reserved - swap_reserved(kernel)))
+                    return reclaimed;
+                int pfn = swap_out(kernel, pid, kernel->reclaim_page, -1);
+                if (pfn == -1) return reclaimed;
+                free_frame(kernel, pfn);
+                mm->page_table->ptes[kernel->reclaim_page].cold = 1;
+                ++kernel->cold_reclaimed;
+                ++reclaimed;
+            }
+            if (reclaimed == max_pages) break;
+        }
+        kernel->reclaim_page = 0;
+        kernel->reclaim_pid = (pid + 1) % MAX_PROCESS_NUM;
+    }
+    return reclaimed;
+}
+
+/* This function will fill the prefetching stats of a user-specified process in,
+ * returns 0 when succeeded, -1 when failed. */
+int proc_get_prefetch_stats(struct Kernel* kernel, int pid, struct PrefetchStats* stats) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || stats == NULL) return -1;
+
+    if (kernel->mm[pid].prefetcher == NULL) memset(stats, 0, sizeof(struct PrefetchStats));
+    else *stats = kernel->mm[pid].prefetcher->stats;
+    return 0;
+}
+
+/* This function will lend a free frame out as a buffer to be donated with vm_write_donate,
+ * counting it against the capacity like a page of a process, returns its content when succeeded, NULL when failed. */
+char* kernel_alloc_frame_buffer(struct Kernel* kernel) {
+    pthread_rwlock_wrlock(&kernel->lock);
+    // A lent frame is one the pages reserved by the processes can no longer fault in
+    int pfn = -1;
+    if (fits(kernel, 1)) {
+        pfn = alloc_frame(kernel);
+        // The capacity left may be in swap slots only, a page goes there to free a frame
+        if (pfn == -1) pfn = swap_out_page(kernel, -1);
+    }
+    if (pfn != -1) {
+        kernel->lent[pfn] = 1;
+        reserve(kernel, 0, 1);
+    }
+    pthread_rwlock_unlock(&kernel->lock);
+    return pfn == -1 ? NULL : kernel->space + (long long) PAGE_SIZE * pfn;
+}
+
+/* This function will tell the frame behind a frame buffer, -1 if buf is not one lent out. */
+static int lent_frame(struct Kernel* kernel, char* buf) {
+    long long offset = buf - kernel->space;
+    if (buf == NULL || 0 > offset || offset >= KERNEL_SPACE_SIZE || offset % PAGE_SIZE) return -1;
+    return kernel->lent[offset / PAGE_SIZE] == 1 ? offset / PAGE_SIZE : -1;
+}
+
+/* This function will take back a frame buffer which was not donated, returns 0 when succeeded, -1 when failed. */
+int kernel_free_frame_buffer(struct Kernel* kernel, char* buf) {
+    pthread_rwlock_wrlock(&kernel->lock);
+    int pfn = lent_frame(kernel, buf);
+    if (pfn != -1) {
+        kernel->lent[pfn] = 0;
+        reserve(kernel, 0, -1);
+        free_frame(kernel, pfn);
+    }
+    pthread_rwlock_unlock(&kernel->lock);
+    return pfn == -1 ? -1 : 0;
+}
+
+/* This function will map npages frame buffers at the page-aligned addr of a user-specified process instead of copying them,
+ * returns 0 when succeeded, -1 when failed (nothing is mapped). */
+int vm_write_donate(struct Kernel* kernel, int pid, char* addr, int npages, char** bufs) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || bufs == NULL || npages <= 0) return -1;
+    long long first = (long long) addr / PAGE_SIZE;
+    if (0 > (long long) addr || (long long) addr % PAGE_SIZE || first + npages - 1 > (kernel->mm[pid].size - 1) / PAGE_SIZE) return -1;
+    if (make_resident(kernel, pid) == -1) return -1;
+
+    long long end = min((first + npages) * PAGE_SIZE, (long long) kernel->mm[pid].size);
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (throttle != NULL) throttle_wait(throttle, throttle_charge(throttle, end - (long long) addr, 0));
+
+    range_lock(kernel, pid, (long long) addr, end, 1);
+    pthread_rwlock_wrlock(&kernel->lock);
+    // Claim every buffer first (2), a buffer given twice is not lent (1) by its second time
+    int claimed = 0;
+    for (; claimed < npages; ++claimed) {
+        int pfn = lent_frame(kernel, bufs[claimed]);
+        if (pfn == -1) break;
+        kernel->lent[pfn] = 2;
+    }
+    int ok = claimed == npages;
+    for (int i = 0; i < claimed; ++i) kernel->lent[(bufs[i] - kernel->space) / PAGE_SIZE] = ok ? 0 : 1;
+
+    if (ok) {
+        reserve(kernel, 0, -npages);
+        struct PTE* ptes = unshare_page_table(kernel, pid)->ptes;
+        for (int i = 0; i < npages; ++i) {
+            struct PTE* pte = &ptes[first + i];
+            // A real-time process keeps one reserved frame per page not backed by one: a page which had a frame
+            // gives it back to the free pool (not to the reserve, which stays as large), any other takes one off the reserve
+            if (kernel->mm[pid].rt_pool != NULL && pte->present && !pte->foreign) free_frame(kernel, pte->PFN);
+            else {
+                if (kernel->mm[pid].rt_pool != NULL && kernel->mm[pid].rt_pool_num > 0)
+                    free_frame(kernel, kernel->mm[pid].rt_pool[--kernel->mm[pid].rt_pool_num]);
+                if (pte->present || pte->swapped) release_page(kernel, pid, pte);
+            }
+            pte->PFN = (bufs[i] - kernel->space) / PAGE_SIZE;
+            pte->present = 1;
+            pte->foreign = 0;
+            pte->swapped = 0;
+            pte->zero = 0;
+            pte->cold = 0;
+            pte->idle_age = 0;
+            pte->accessed = 1;
+        }
+        ++kernel->map_epoch;
+    }
+    pthread_rwlock_unlock(&kernel->lock);
+    range_unlock(kernel, pid, (long long) addr, end, 1);
+    return ok ? 0 : -1;
+}
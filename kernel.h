@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,12 +8,42 @@ extern int KERNEL_SPACE_SIZE;
 extern int VIRTUAL_SPACE_SIZE;
 extern int PAGE_SIZE;
 extern int MAX_PROCESS_NUM;
+// vm_read/vm_write of >= PARALLEL_COPY_THRESHOLD bytes are copied by PARALLEL_COPY_THREADS threads (0 -> disabled).
+extern int PARALLEL_COPY_THRESHOLD;
+extern int PARALLEL_COPY_THREADS;
+// The number of threads compressing / decompressing checkpoint chunks.
+extern int CHECKPOINT_THREADS;
+// How a free frame is chosen (ALLOC_FIRST_FIT by default).
+extern int ALLOC_POLICY;
+// How a page to swap out is chosen (REPLACE_CLOCK by default).
+extern int REPLACEMENT_POLICY;
+// The number of following untouched pages mapped together with a faulting page (0 by default).
+extern int FAULT_AROUND_PAGES;
+// kernel_report_free_pages runs by itself once this many frames have been freed since its last run (0 -> never).
+extern int FREE_PAGE_REPORTING_BATCH;
+// The number of swapped out pages read in ahead of a fault, predicted from its stride or fault sequence (0 -> never).
+extern int PREFETCH_PAGES;
+// The number of recently freed frames a fault takes first, most recent first, when the kernel is created (0 -> none).
+extern int HOT_FRAMES;
+// 1 if vm_write (parallel copies included) and vm_write_batch map a whole page of zeros to the zero state instead of
+// a frame (0 by default), the strided and handle-based writes always copy.
+extern int ZERO_PAGE_DETECTION;
+
+#define ALLOC_FIRST_FIT 0
+#define ALLOC_NEXT_FIT 1
+#define REPLACE_CLOCK 0   // Second chance over the accessed bits.
+#define REPLACE_FIFO 1    // Round-robin over the pages, ignoring the accessed bits.
 
 #define min(a,b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a < _b ? _a : _b; })
 
+#define max(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
 /*
   To make it simple, we do not encode PFN and flag bits together to an integer.
   PTE: page table entry.
@@ -26,10 +57,17 @@ extern int MAX_PROCESS_NUM;
 struct PTE {
   int PFN;
   char present;
+  char foreign;         // 1 if the page is mapped onto host memory (vm_attach_host_memory), PFN is then past the end of kernel->space.
+  char swapped;         // 1 if the (not present) page has been swapped out, PFN is then its swap entry (SWAP_ENTRY).
+  char accessed;        // Set on every access, cleared by the clock hand looking for a page to swap out.
+  unsigned char idle_age; // The number of kernel_scan_idle periods the page has not been accessed for.
+  char cold;            // 1 if the page was swapped out by kernel_reclaim_cold.
+  char zero;            // 1 if the (not present) page holds only zeros, it gets a zero-filled frame on its next fault.
 };
 
 struct PageTable {
   struct PTE* ptes;
+  int refs;             // The number of kernels (clones) sharing this page table, it is copied on the first PTE update.
 };
 
 /*
@@ -40,8 +78,158 @@ struct PageTable {
 struct MMStruct {
   int size;
   struct PageTable* page_table;
+  int generation;       // Bumped whenever the process slot is created or exited, used to detect stale handles.
+  int* rt_pool;         // NULL unless created by proc_create_vm_rt, else a stack of the frames set aside for the process.
+  int rt_pool_num;
+  int hibernate_fd;     // -1 unless hibernated (proc_hibernate_vm), else the image file and page_table is NULL.
+  int reclaim_age;      // kernel_reclaim_cold takes the pages idle for at least this many scans (0 -> never).
+  struct Throttle* throttle; // NULL unless limited by proc_set_throttle.
+  struct Prefetcher* prefetcher; // NULL until the first fault with PREFETCH_PAGES set.
+  int* heap_spans;      // NULL until the first large vm_malloc, else for every page the pages of the heap span starting there
+                        // (< 0 while free, 0 if none starts there), the kernel's own record of what vm_free may release.
+};
+
+/*
+  Frames frozen by kernel_clone, shared copy-on-write by the kernels cloned from the same state.
+  A frame whose cow byte is 1 is not in space but somewhere further down the base chain.
+*/
+struct FrameStore {
+  char* space;
+  char* cow;
+  struct FrameStore* base;
+  int refs;
+};
+
+/*
+  Swap devices, a swapped out page is identified by its swap entry: the device index and the slot in that device.
+  1. Slots are taken from the devices of the highest priority that still have free slots.
+  2. Devices of equal priority are striped round-robin, SWAP_CLUSTER slots from one device before moving on.
+  3. slot_refs counts the page tables referring to a slot (page tables are shared by kernel_clone),
+     the slot is free again when it drops to 0.
+*/
+#define SWAP_CLUSTER 16
+#define SWAP_MAX_DEVICES 128
+#define SWAP_ENTRY(dev, slot) ((dev) << 24 | (slot))
+#define SWAP_DEV(entry) ((entry) >> 24)
+#define SWAP_SLOT(entry) ((entry) & 0xffffff)
+
+struct SwapStats {
+  long long pages_in;   // Pages read back from the device.
+  long long pages_out;  // Pages written to the device.
+  long long io_ns;      // Time spent in reads and writes of the device.
+  int slots;
+  int used_slots;
+};
+
+struct SwapDevice {
+  int fd;
+  int priority;
+  int slots;
+  int used_slots;
+  int next_slot;        // Where the search for a free slot starts (next fit).
+  int* slot_refs;
+  struct SwapStats stats;
+};
+
+struct SwapArea {
+  struct SwapDevice* devices;
+  int num;
+  int total_slots;
+  int cursor;           // The device striping is currently on.
+  int cluster_left;     // Slots left to take from cursor before moving to the next device of the same priority.
+  int refs;             // The number of kernels (clones) sharing the swap area.
+  int reserved;         // The slots counted on by those kernels, see swap_reserved.
+};
+
+#define PRESSURE_SECONDS 300
+#define PRESSURE_MAX_TRIGGERS 16
+
+struct PressureStats {
+  double some_avg10, some_avg60, some_avg300; // Per cent of the time a fault was stalled over the last 10/60/300 s.
+  double full_avg10, full_avg60, full_avg300; // The same for the stalls of the whole kernel (no free frame at all).
+  long long some_total_ns;
+  long long full_total_ns;
+  int free_frames;
+};
+
+struct PressureTrigger {
+  int fd;               // The eventfd of the subscriber.
+  int full;
+  int window;           // Seconds, 0 for a free frame trigger.
+  double percent;
+  int free_frames;
+  char fired;           // 1 while the threshold is crossed, the subscriber is signalled once per crossing.
+  long long checked_sec;
+};
+
+struct Pressure {
+  long long bucket_sec[PRESSURE_SECONDS]; // The second each bucket of the ring is currently counting.
+  long long some_ns[PRESSURE_SECONDS];
+  long long full_ns[PRESSURE_SECONDS];
+  long long some_total, full_total;
+  struct PressureTrigger triggers[PRESSURE_MAX_TRIGGERS];
+  int trigger_num;
+};
+
+struct TokenBucket {
+  double rate;          // Tokens per second, 0 for no limit, at most one second worth is saved up.
+  double tokens;        // Negative when in debt.
+  long long last_ns;
 };
 
+struct ThrottleStats {
+  long long bytes;      // Bytes copied by vm_read/vm_write.
+  long long faults;
+  long long throttled_calls;
+  long long throttled_ns; // Time vm_read/vm_write were held back.
+  long long bytes_per_sec;
+  int faults_per_sec;
+};
+
+struct Throttle {
+  pthread_mutex_t mutex;
+  struct TokenBucket bytes, faults;
+  struct ThrottleStats stats;
+};
+
+#define PREFETCH_HISTORY 64
+
+struct PrefetchStats {
+  long long issued;     // Pages read in ahead.
+  long long hits;       // Of which accessed before being evicted again.
+  long long misses;
+  int enabled;          // 0 while turned off for missing too often.
+};
+
+struct Prefetcher {
+  int last_page, stride;
+  char stride_confirmed;  // 1 if the last two faults were stride apart.
+  int seq_page[PREFETCH_HISTORY], seq_next[PREFETCH_HISTORY]; // The fault which followed a fault at seq_page last time.
+  int pending[PREFETCH_HISTORY];             // The pages read in ahead and not judged yet.
+  long long pending_fault[PREFETCH_HISTORY]; // The fault they were read in at.
+  int pending_num;
+  long long faults;
+  int window_hits, window_misses;
+  long long off_until;    // The fault prefetching is turned on again at.
+  struct PrefetchStats stats;
+};
+
+struct LockedRange {
+  long long lo, hi;     // [lo, hi) of the process' virtual memory.
+  int write;
+};
+
+// The accesses in progress on the memory of one process, see vm_read/vm_write.
+struct RangeLock {
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+  struct LockedRange* held;
+  int num, cap;
+};
+
+// Copies one whole page (PAGE_SIZE bytes) from src to dst.
+typedef void (*CopyPageFn)(char* dst, const char* src);
+
 // The Kernel manages MAX_PROCESS_NUM of processes.
 struct Kernel {
   char* space;
@@ -49,14 +237,86 @@ struct Kernel {
   char* occupied_pages; // For simplicity, we use a char array to indicate the free pages, 0 for free, 1 for occupied.
   char* running;        // An array marking if the process is running.
   struct MMStruct* mm;  // An array of MMStruct for each process.
+  char* cow;            // NULL if never cloned, else 1 for the frames whose content is still in base.
+  struct FrameStore* base;
+  unsigned int map_epoch; // Bumped whenever a translation is torn down or a page table is replaced.
+  char** foreign_frames;  // Host memory mapped by vm_attach_host_memory, foreign PFN i is slot i - (the number of frames).
+  int foreign_num;        // The number of slots in foreign_frames.
+  int* foreign_free;      // A stack of the free slots in foreign_frames.
+  int foreign_free_num;
+  struct SwapArea* swap;  // NULL until the first swap_add.
+  int clock_pid, clock_page; // The clock hand looking for a page to swap out.
+  int next_fit;           // Where the next fit policy starts looking for a free frame.
+  int* hot;               // A ring of the last hot_cap frames freed, hot_num of them (before hot_top) still listed.
+  int hot_cap, hot_num, hot_top;
+  char* free_seen;        // 1 if the frame was already free at the last kernel_report_free_pages and has stayed free.
+  char* reported;         // 1 if the host memory behind the (free) frame has been handed back to the OS.
+  int freed_since_report;
+  int reclaim_pid, reclaim_page; // Where kernel_reclaim_cold carries on.
+  long long cold_reclaimed;      // Pages swapped out by kernel_reclaim_cold.
+  long long cold_refaults;       // Of which faulted back in.
+  int free_frames;               // The number of frames not in occupied_pages.
+  struct Pressure* pressure;
+  pthread_rwlock_t lock;         // Held for reading while copying from / to frames, for writing to change mappings.
+  struct RangeLock* range_locks; // One per process.
+  CopyPageFn copy_page;          // Specialized for PAGE_SIZE and the CPU by init_kernel.
+  char* lent;                    // 1 for the frames lent out by kernel_alloc_frame_buffer.
+  int lent_num;
 };
 
+/*
+  Create a kernel for the current KERNEL_SPACE_SIZE, PAGE_SIZE and MAX_PROCESS_NUM (and HOT_FRAMES),
+  which must not change for the lifetime of the kernel.
+  Whole pages in the middle of a vm_read/vm_write are copied by a copy picked here for PAGE_SIZE
+  (32 and 64 bytes take single AVX2 moves when the CPU has them, 4096 bytes a fixed size memcpy).
+*/
 struct Kernel* init_kernel();
+CopyPageFn select_copy_page();
 void destroy_kernel(struct Kernel* kernel);
+
+/*
+  Branch the whole paging state, the returned kernel is logically independent of the original one.
+  1. The frames of kernel->space are frozen and shared copy-on-write, a frame is copied on its first write.
+  2. The page tables are shared copy-on-write, a page table is copied on its first PTE update.
+  3. Only the per-frame and per-process bookkeeping arrays are copied eagerly.
+  Return the new kernel, to be released with destroy_kernel (in any order with the original one),
+  NULL when frame buffers are lent out (kernel_alloc_frame_buffer), whose memory would be frozen,
+  or when the swap slots shared with the clone cannot back the pages of both (see swap_add).
+*/
+struct Kernel* kernel_clone(struct Kernel* kernel);
 void print_kernel_free_space(struct Kernel* kernel);
 void get_kernel_free_space_info(struct Kernel* kernel, char* buf);
 void print_memory_mappings(struct Kernel* kernel, int pid);
 
+/*
+  Swap space, once added, a fault finding no free frame swaps out a page (clock policy) instead of failing,
+  and processes may reserve up to the number of frames plus the number of swap slots.
+  Clones (kernel_clone) share the swap area of the original kernel and its slots with it: a kernel counts on as many
+  slots as it has pages reserved (and frame buffers lent) beyond its frames, and may only reserve more while the slots
+  counted on by all the kernels sharing the area stay within its slots. kernel_clone fails (NULL) when the clone
+  would already count on more slots than the other kernels leave, and kernel_reclaim_cold only fills the slots left.
+  swap_add creates (or truncates) the file at path with room for slots pages,
+  returns the device index (>= 0) when success, -1 when failure.
+  swap_get_stats copies the I/O statistics of a device to stats, returns 0 when success, -1 when failure.
+*/
+int swap_add(struct Kernel* kernel, const char* path, int slots, int priority);
+int swap_get_stats(struct Kernel* kernel, int dev, struct SwapStats* stats);
+
+// Used by the other parts of the kernel to reach the content of a frame (copy-on-write aware), see kernel.c.
+char* frame_ptr(struct Kernel* kernel, int pfn, int write);
+// Used by the other parts of the kernel to tell zero pages (SSE2 when available), see kernel.c.
+int is_zero(const char* buf, int size);
+
+// Used by the kernel to move pages between frames and swap slots, see swap.c.
+int swap_reserved(struct Kernel* kernel);
+int swap_used_slots(struct SwapArea* area);
+int swap_alloc_slot(struct SwapArea* area);
+void swap_slot_get(struct SwapArea* area, int entry);
+void swap_slot_put(struct SwapArea* area, int entry);
+int swap_write_page(struct SwapArea* area, int entry, const char* page);
+int swap_read_page(struct SwapArea* area, int entry, char* page);
+void swap_release_area(struct SwapArea* area);
+
 /*
   1. Check if a free process slot exists and if the there's enough free space (check allocated_pages).
   2. Alloc space for page_table (the size of it depends on how many pages you need) and update allocated_pages.
@@ -65,11 +325,27 @@ void print_memory_mappings(struct Kernel* kernel, int pid);
 */
 int proc_create_vm(struct Kernel* kernel, int size);
 
+/*
+  Create a real-time process, the same as proc_create_vm plus:
+  1. A free frame is set aside for every page of the process at creation (searched once here, O(frames)),
+     they stay occupied and are popped from the process's pool in O(1) by its faults.
+  2. Its pages are never swapped out, and pages it releases (vm_punch_hole) go back to its pool.
+  Worst-case latency of vm_read/vm_write on a real-time process: O(pages + size), with no frame search and no swap I/O
+  (a frame still shared with a clone costs one extra PAGE_SIZE copy on its first write).
+  Return a pid >= 0 when success, -1 when failure (also when there are not enough free frames right now).
+*/
+int proc_create_vm_rt(struct Kernel* kernel, int size);
+
 /*
   This function will read the range [addr, addr+size) from user space of a specific process to the buf (buf should be >= size).
   1. Check if the reading range is out-of-bounds.
   2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
      you should firstly map them to the free kernel-managed memory pages (first fit policy).
+  3. If size >= PARALLEL_COPY_THRESHOLD (when enabled), all pages are mapped up front and
+     the copy is split by page ranges across PARALLEL_COPY_THREADS threads.
+  4. vm_read and vm_write may be called from several threads at once on one kernel: accesses to disjoint ranges
+     (or reads only) of a process copy in parallel, overlapping ones with a write are atomic to each other.
+     Other calls must not run concurrently with them.
   Return 0 when success, -1 when failure (out of bounds).
 */
 int vm_read(struct Kernel* kernel, int pid, char* addr, int size, char* buf);
@@ -79,10 +355,45 @@ int vm_read(struct Kernel* kernel, int pid, char* addr, int size, char* buf);
   1. Check if the writing range is out-of-bounds.
   2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
      you should firstly map them to the free kernel-managed memory pages (first fit policy).
+  3. If size >= PARALLEL_COPY_THRESHOLD (when enabled), all pages are mapped up front and
+     the copy is split by page ranges across PARALLEL_COPY_THREADS threads.
   Return 0 when success, -1 when failure (out of bounds).
 */
 int vm_write(struct Kernel* kernel, int pid, char* addr, int size, char* buf);
 
+/*
+  Strided gather / scatter, e.g. a column of row-major records: element i is the elem_size bytes at base + i * stride.
+  1. The whole access is checked up front (stride >= elem_size, the last element within the process),
+     nothing is copied if it does not pass.
+  2. vm_read_strided gathers the count elements into buf packed (count * elem_size bytes), vm_write_strided scatters
+     them from there, every page is translated (and mapped if needed) once for all the elements it holds.
+  3. They may run concurrently with vm_read/vm_write, as one access to [base, last element end).
+  Return 0 when success, -1 when failure.
+*/
+int vm_read_strided(struct Kernel* kernel, int pid, char* base, int elem_size, int stride, int count, char* buf);
+int vm_write_strided(struct Kernel* kernel, int pid, char* base, int elem_size, int stride, int count, char* buf);
+
+#define BATCH_PREFETCH_DISTANCE 8
+
+struct VMAccess {
+  int pid;
+  char* addr;
+  int size;
+  char* buf;
+};
+
+/*
+  Batched accesses, for many small random accesses (of any processes) at once.
+  1. The accesses run in order as vm_read/vm_write would, the batch as a whole is atomic to the other accesses:
+     it holds, for every process it touches, the span of its accesses to it (so keep a batch's accesses close).
+     A hibernated process is resumed by its first access, a failed resume fails that access.
+  2. Translation runs ahead of the copies: the PTE of the access BATCH_PREFETCH_DISTANCE ahead and the frame
+     of the one half as far ahead are prefetched, so that the memory latency of each is hidden behind the copies.
+  Return the number of accesses done, n when success, less when an access failed (it and the following are not done).
+*/
+int vm_read_batch(struct Kernel* kernel, struct VMAccess* accesses, int n);
+int vm_write_batch(struct Kernel* kernel, struct VMAccess* accesses, int n);
+
 /*
   This function will free the space of a process.
   1. Reset the corresponding pages in occupied_pages to 0.
@@ -90,3 +401,178 @@ int vm_write(struct Kernel* kernel, int pid, char* addr, int size, char* buf);
   Return 0 when success, -1 when failure.
 */
 int proc_exit_vm(struct Kernel* kernel, int pid);
+
+/*
+  Atomic operations on a 64-bit word of user space, done directly on the backing frame with host atomics.
+  1. addr must be 8-byte aligned and the word must lie inside [0, size) of the process.
+  2. The page is mapped first (first fit policy) if it is not present, the translation is done only once.
+  3. The previous value of the word is stored to *old, for vm_cas the swap happened iff *old == expected.
+  Return 0 when success, -1 when failure (bad pid, out of bounds, misaligned or out of memory).
+  They may run concurrently with each other and with vm_read/vm_write, the frame stays put until the update is done.
+  Note: only the update of the word is atomic, not its ordering with respect to an overlapping vm_write.
+*/
+int vm_cas(struct Kernel* kernel, int pid, char* addr, int64_t expected, int64_t desired, int64_t* old);
+int vm_fetch_add(struct Kernel* kernel, int pid, char* addr, int64_t val, int64_t* old);
+int vm_exchange(struct Kernel* kernel, int pid, char* addr, int64_t val, int64_t* old);
+
+/*
+  This function will release the frames behind the pages of [addr, addr+size) of a process (like madvise(MADV_DONTNEED)).
+  1. Only whole pages are released, partially covered pages at both ends are kept.
+  2. The released pages become not present (PFN = -1, present = 0), their next access maps a new frame.
+  Return 0 when success, -1 when failure (bad pid or out of bounds).
+*/
+int vm_punch_hole(struct Kernel* kernel, int pid, char* addr, int size);
+
+/*
+  A size-class heap inside the user space of a process, all its metadata lives in the process memory itself.
+  1. The heap header takes [0, HEAP_HEADER_SIZE) of the user space, it is set up by the first vm_malloc.
+  2. Requests up to HEAP_MAX_SMALL bytes come from power-of-two size classes (16 ~ 2048 bytes with the block header),
+     bigger ones get page-aligned spans whose whole pages are hole-punched (vm_punch_hole) by vm_free.
+  3. The returned addresses are user space addresses to be used with vm_read/vm_write.
+  4. The large spans are also recorded outside the process (MMStruct heap_spans): vm_free only releases a span
+     recorded as allocated with the size its header tells, so a forged header cannot make it punch any other range.
+  vm_malloc returns NULL when failure (bad pid, the user space is used up or a free span header was corrupted).
+  vm_free returns 0 when success, -1 when failure (bad pid or addr is not an allocated block).
+*/
+#define HEAP_HEADER_SIZE 96
+#define HEAP_MAX_SMALL (2048 - 8)
+char* vm_malloc(struct Kernel* kernel, int pid, int size);
+int vm_free(struct Kernel* kernel, int pid, char* addr);
+
+/*
+  An opaque handle on a process caching its MMStruct, page table base and last translation.
+  1. proc_open returns NULL when the pid is not running, proc_close releases the handle.
+  2. vm_read_handle/vm_write_handle behave like vm_read/vm_write, an access within one page skips the pid lookup
+     and reuses the last translation while no mapping has been torn down since (see map_epoch).
+  3. Once the process exits, every access through the handle returns -1 (even if the pid is reused).
+*/
+struct ProcHandle;
+struct ProcHandle* proc_open(struct Kernel* kernel, int pid);
+void proc_close(struct ProcHandle* handle);
+int vm_read_handle(struct ProcHandle* handle, char* addr, int size, char* buf);
+int vm_write_handle(struct ProcHandle* handle, char* addr, int size, char* buf);
+
+/*
+  This function will map [addr, addr+len) of a process onto host memory without copying (zero-copy import).
+  1. addr and host_ptr must be PAGE_SIZE aligned, len must be a multiple of PAGE_SIZE unless the range ends at the process size.
+  2. Each page becomes a foreign PTE referring to host memory, it never comes from (or goes back to) the first-fit pool.
+  3. The host memory stays owned by the caller and must outlive the mapping (until proc_exit_vm or vm_punch_hole),
+     clones made by kernel_clone share it instead of copying it.
+  Return 0 when success, -1 when failure (bad pid, out of bounds or misaligned).
+*/
+int vm_attach_host_memory(struct Kernel* kernel, int pid, char* addr, char* host_ptr, int len);
+
+/*
+  Checkpoint the kernel-managed memory and the page tables to a file, and restore a kernel from it.
+  1. Free frames are skipped, all-zero frames are stored as a flag only.
+  2. The other frames are compressed (zlib, fastest level) in chunks of CHECKPOINT_CHUNK_FRAMES frames
+     by CHECKPOINT_THREADS threads, an index of the chunks at the end of the file allows restoring any chunk on its own.
+  3. Swapped out pages, host memory (vm_attach_host_memory) and hibernated processes cannot be checkpointed.
+  kernel_checkpoint returns 0 when success, -1 when failure (I/O error, swapped out, host memory or hibernated pages,
+  or frame buffers lent out).
+  kernel_restore returns the restored kernel, NULL when failure (I/O error, corrupted file or
+  KERNEL_SPACE_SIZE/VIRTUAL_SPACE_SIZE/PAGE_SIZE/MAX_PROCESS_NUM differing from the checkpointed ones).
+*/
+#define CHECKPOINT_CHUNK_FRAMES 256
+int kernel_checkpoint(struct Kernel* kernel, const char* path);
+struct Kernel* kernel_restore(const char* path);
+
+/*
+  Free page reporting: hand the host memory behind long-free frames back to the OS (madvise(MADV_DONTNEED)).
+  1. A frame is long-free if it was already free at the previous run and has not been taken since.
+  2. Only whole host pages are released, so all the frames sharing a host page must be long-free (or reported).
+  3. A released frame reads as zeros, the OS fills it lazily when it is taken again.
+  It runs by itself every FREE_PAGE_REPORTING_BATCH freed frames when that is set.
+  Return the number of bytes of host memory released by this run.
+*/
+long long kernel_report_free_pages(struct Kernel* kernel);
+
+/*
+  Hibernation: suspend an idle process entirely to disk.
+  1. proc_hibernate_vm writes the page states and the content of every touched page (swapped out ones included)
+     to a file at path, which is unlinked right away, then releases all the frames, swap slots and reservation.
+  2. The process keeps its pid and size (a stub), its next access (vm_read, vm_write, ...) brings it back lazily,
+     or proc_resume_vm brings it back eagerly, which needs the reservation again (see proc_create_vm).
+  3. Host memory pages (vm_attach_host_memory) are attached again on resume, the host memory must stay valid.
+  Return 0 when success, -1 when failure (bad pid, already hibernated, I/O error, or no room to resume).
+*/
+int proc_hibernate_vm(struct Kernel* kernel, int pid, const char* path);
+int proc_resume_vm(struct Kernel* kernel, int pid);
+
+/*
+  Proactive cold page reclaim, run periodically instead of waiting for faults to find no free frame.
+  1. kernel_scan_idle ages the present pages: idle_age is reset by an access and grows by one per scan otherwise.
+  2. proc_set_reclaim_age sets per process how many scans a page must stay idle to be cold (0 -> never, the default).
+  3. kernel_reclaim_cold swaps out (and frees the frames of) at most max_pages cold pages per call, which sets the rate,
+     cold_reclaimed and cold_refaults of the kernel tell how many of them were needed again.
+  kernel_scan_idle returns the number of pages scanned, kernel_reclaim_cold the number of pages reclaimed,
+  proc_set_reclaim_age returns 0 when success, -1 when failure (bad pid or age not in [0, 255]).
+*/
+int kernel_scan_idle(struct Kernel* kernel);
+int proc_set_reclaim_age(struct Kernel* kernel, int pid, int age);
+int kernel_reclaim_cold(struct Kernel* kernel, int max_pages);
+
+/*
+  Memory pressure, for admission control to back off before vm_read/vm_write start failing.
+  1. A fault stalls on direct reclaim (no free frame, a page has to be swapped out first) and on reading a page
+     back from swap, "some" counts all of them and "full" only direct reclaim, which would stall any fault.
+  2. pressure_get_stats gives the stall time in per cent over the last 10, 60 and 300 seconds and the free frames.
+  3. pressure_subscribe returns an eventfd, signalled (read() gives the count) each time the some (full = 0) or full
+     stall time over the last window seconds reaches percent, or for a 0 window, each time fewer than free_frames
+     frames are left, pressure_unsubscribe closes it, destroy_kernel closes those left.
+  4. pressure_clock is the monotonic clock in ns the stalls are timed with, swap I/O and throttling use it too.
+  pressure_subscribe returns the eventfd, -1 when failure (bad threshold or PRESSURE_MAX_TRIGGERS subscribers),
+  the others return 0 when success, -1 when failure.
+*/
+int pressure_get_stats(struct Kernel* kernel, struct PressureStats* stats);
+int pressure_subscribe(struct Kernel* kernel, int full, int window, double percent, int free_frames);
+int pressure_unsubscribe(struct Kernel* kernel, int fd);
+long long pressure_clock();
+void pressure_record(struct Kernel* kernel, long long start, int full);
+void pressure_check(struct Kernel* kernel, int stalled);
+void pressure_release(struct Pressure* pressure);
+
+/*
+  Throttling, so that a noisy process does not starve the others sharing the kernel of copy bandwidth and frames.
+  1. proc_set_throttle limits a process to bytes_per_sec bytes copied by vm_read/vm_write and faults_per_sec faults,
+     each a token bucket saving up at most one second worth (0 for no limit, both 0 to lift the throttle).
+  2. A call runs into debt instead of being split, the call itself (bytes) or the next one (faults) then sleeps
+     until the debt is paid back, the throttle lock is only taken by the calls of throttled processes.
+  3. proc_get_throttle_stats gives the bytes and faults accounted and how often and how long the process was held back.
+  The limits follow kernel_clone (with full buckets), not checkpoints.
+  Return 0 when success, -1 when failure (bad pid or negative limit).
+*/
+int proc_set_throttle(struct Kernel* kernel, int pid, long long bytes_per_sec, int faults_per_sec);
+int proc_get_throttle_stats(struct Kernel* kernel, int pid, struct ThrottleStats* stats);
+long long throttle_charge(struct Throttle* throttle, long long bytes, int faults);
+void throttle_wait(struct Throttle* throttle, long long wait);
+struct Throttle* throttle_copy(struct Throttle* throttle);
+void throttle_release(struct Throttle* throttle);
+
+/*
+  Prefetching of swapped out pages, for the strided and interleaved patterns fault-around misses.
+  1. Every fault of a process feeds its prefetcher: a stride seen twice in a row predicts the next PREFETCH_PAGES
+     pages along it, otherwise the faults which followed this one last time (PREFETCH_HISTORY remembered) do.
+  2. Predicted pages that are swapped out are read in before the faulting page is mapped (evicting pages if needed).
+  3. A page read in ahead is a hit if accessed before it is evicted or PREFETCH_HISTORY faults pass, a miss otherwise,
+     when half of 32 judged pages miss, the process stops prefetching for the next 256 faults.
+  proc_get_prefetch_stats returns 0 when success, -1 when failure (bad pid), all 0 before the first prefetch.
+*/
+int proc_get_prefetch_stats(struct Kernel* kernel, int pid, struct PrefetchStats* stats);
+
+/*
+  Page flipping: a whole-page write from a buffer the caller is done with costs a PTE update instead of a copy.
+  1. kernel_alloc_frame_buffer lends a free frame out as a PAGE_SIZE buffer (swapping a page out when every frame is
+     mapped, NULL when the capacity is used up),
+     kernel_free_frame_buffer takes back one that was not donated.
+     Until then a lent frame counts against the capacity like a page of a process: no buffer is lent out of the frames
+     (and swap slots) the processes have reserved, and proc_create_vm and proc_resume_vm leave the lent frames out.
+  2. vm_write_donate maps npages frame buffers at the page-aligned addr of a process, bufs[i] becoming the frame of
+     page addr / PAGE_SIZE + i, the frames (or swap slots, or host memory) behind those pages are released,
+     the buffers belong to the process from then on and must not be touched by the caller any more.
+  3. Nothing is mapped unless every buffer is a distinct frame buffer lent out by this kernel.
+  Return 0 when success, -1 when failure.
+*/
+char* kernel_alloc_frame_buffer(struct Kernel* kernel);
+int kernel_free_frame_buffer(struct Kernel* kernel, char* buf);
+int vm_write_donate(struct Kernel* kernel, int pid, char* addr, int npages, char** bufs);
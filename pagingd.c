@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kernel.h"
+#include "pagingd.h"
+
+/* Daemon: owns one Kernel and serves it over a Unix domain socket (see pagingd.h), one thread per client.
+ *
+ * vm_read/vm_write of the clients run concurrently on the kernel (it allows that), every other call holds them off
+ * through the ops lock. Only the data plane touches the ring, the socket carries the fixed-size requests only.
+ *
+ * Usage: ./pagingd [-S socket path] [-k KERNEL_SPACE_SIZE] [-v VIRTUAL_SPACE_SIZE] [-p PAGE_SIZE] [-m MAX_PROCESS_NUM] */
+
+struct Client {
+    int fd;
+    char* ring;
+};
+
+static struct Kernel* kernel;
+static pthread_rwlock_t ops = PTHREAD_RWLOCK_INITIALIZER;
+static struct Client** owners;   // The client of every running pid, written under the ops write lock.
+static const char* socket_path = PAGINGD_SOCKET;
+
+static int recv_all(int fd, void* buf, int size) {
+    for (int done = 0; done < size;) {
+        ssize_t n = recv(fd, (char*) buf + done, size - done, 0);
+        if (n == 0 || (n == -1 && errno != EINTR)) return -1;
+        if (n > 0) done += n;
+    }
+    return 0;
+}
+
+static int send_all(int fd, const void* buf, int size) {
+    for (int done = 0; done < size;) {
+        ssize_t n = send(fd, (const char*) buf + done, size - done, MSG_NOSIGNAL);
+        if (n == -1 && errno != EINTR) return -1;
+        if (n > 0) done += n;
+    }
+    return 0;
+}
+
+/* This function will create the ring of a new client and pass it over with SCM_RIGHTS, returns 0 when succeeded, -1 when failed. */
+static int hand_ring(struct Client* client) {
+    int memfd = memfd_create("pagingd-ring", MFD_CLOEXEC);
+    if (memfd == -1) return -1;
+    if (ftruncate(memfd, PAGINGD_RING_SIZE) == -1) {
+        close(memfd);
+        return -1;
+    }
+    client->ring = mmap(NULL, PAGINGD_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (client->ring == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+
+    char data = 0;
+    struct iovec iov = {&data, 1};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    int ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+    // The client keeps the ring alive through its own mapping
+    close(memfd);
+    if (ret == -1) munmap(client->ring, PAGINGD_RING_SIZE);
+    return ret;
+}
+
+/* This function will run one request of a client, returns what the kernel call returned, -1 for a bad request. */
+static int serve(struct Client* client, struct PagingdRequest* req) {
+    if (req->op == PAGINGD_CREATE) {
+        pthread_rwlock_wrlock(&ops);
+        int pid = proc_create_vm(kernel, req->addr);
+        if (pid != -1) owners[pid] = client;
+        pthread_rwlock_unlock(&ops);
+        return pid;
+    }
+    if (0 > req->pid || req->pid >= MAX_PROCESS_NUM) return -1;
+    if (req->op == PAGINGD_EXIT) {
+        pthread_rwlock_wrlock(&ops);
+        int ret = -1;
+        if (owners[req->pid] == client) {
+            ret = proc_exit_vm(kernel, req->pid);
+            owners[req->pid] = NULL;
+        }
+        pthread_rwlock_unlock(&ops);
+        return ret;
+    }
+    if (req->op != PAGINGD_READ && req->op != PAGINGD_WRITE) return -1;
+    if (0 > req->slot || req->slot >= PAGINGD_SLOTS || req->size > PAGINGD_SLOT_SIZE) return -1;
+
+    char* payload = client->ring + (long) req->slot * PAGINGD_SLOT_SIZE;
+    char* addr = (char*) (long) req->addr;
+    pthread_rwlock_rdlock(&ops);
+    int ret = -1;
+    if (owners[req->pid] == client) {
+        if (req->op == PAGINGD_READ) ret = vm_read(kernel, req->pid, addr, req->size, payload);
+        else ret = vm_write(kernel, req->pid, addr, req->size, payload);
+    }
+    pthread_rwlock_unlock(&ops);
+    return ret;
+}
+
+/* This function will serve a client until it disconnects, then exit the processes it left behind. */
+static void* client_main(void* arg) {
+    struct Client* client = arg;
+    if (hand_ring(client) == 0) {
+        struct PagingdRequest req;
+        while (recv_all(client->fd, &req, sizeof(req)) == 0) {
+            struct PagingdReply reply = {serve(client, &req)};
+            if (send_all(client->fd, &reply, sizeof(reply)) == -1) break;
+        }
+        munmap(client->ring, PAGINGD_RING_SIZE);
+    }
+
+    pthread_rwlock_wrlock(&ops);
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid)
+        if (owners[pid] == client) {
+            proc_exit_vm(kernel, pid);
+            owners[pid] = NULL;
+        }
+    pthread_rwlock_unlock(&ops);
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+static void stop(int sig) {
+    (void) sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "S:k:v:p:m:")) != -1) {
+        if (opt == 'S') socket_path = optarg;
+        else if (opt == 'k') KERNEL_SPACE_SIZE = atoi(optarg);
+        else if (opt == 'v') VIRTUAL_SPACE_SIZE = atoi(optarg);
+        else if (opt == 'p') PAGE_SIZE = atoi(optarg);
+        else if (opt == 'm') MAX_PROCESS_NUM = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-S socket] [-k kernel space] [-v virtual space] [-p page size] [-m processes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct sockaddr_un sun = {0};
+    sun.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "pagingd: socket path too long\n");
+        return 1;
+    }
+    strcpy(sun.sun_path, socket_path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*) &sun, sizeof(sun)) == -1 || listen(listen_fd, 16) == -1) {
+        perror("pagingd");
+        return 1;
+    }
+
+    kernel = init_kernel();
+    owners = calloc(MAX_PROCESS_NUM, sizeof(struct Client*));
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+    printf("pagingd: listening on %s\n", socket_path);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) continue;
+        struct Client* client = calloc(1, sizeof(struct Client));
+        client->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, client_main, client) != 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef PAGINGD_H
+#define PAGINGD_H
+
+/* Daemon mode: pagingd owns one Kernel and serves it to the client processes of a host.
+ *
+ * Control plane: a Unix domain stream socket, one fixed-size PagingdRequest per call, answered in order by one
+ * PagingdReply. Data plane: on connect the daemon hands the client a shared memory ring (a memfd, passed with
+ * SCM_RIGHTS) of PAGINGD_SLOTS slots of PAGINGD_SLOT_SIZE bytes; read/write payloads are put in / taken from a slot
+ * and never go through the socket. A client may keep up to PAGINGD_SLOTS requests in flight, one per slot. */
+
+#define PAGINGD_SOCKET "/tmp/pagingd.sock"
+#define PAGINGD_SLOTS 8
+#define PAGINGD_SLOT_SIZE (64 * 1024)
+#define PAGINGD_RING_SIZE (PAGINGD_SLOTS * PAGINGD_SLOT_SIZE)
+
+enum PagingdOp {
+    PAGINGD_CREATE,
+    PAGINGD_EXIT,
+    PAGINGD_READ,
+    PAGINGD_WRITE,
+};
+
+struct PagingdRequest {
+    int op;
+    int pid;
+    int addr;        // PAGINGD_CREATE: the size of the process.
+    int size;        // At most PAGINGD_SLOT_SIZE.
+    int slot;        // Where the payload is in the ring.
+};
+
+struct PagingdReply {
+    int ret;         // What the kernel.h call returned.
+};
+
+/* Client library, mirroring kernel.h. A client only sees the processes it created, they exit when it disconnects.
+ * One client must not be used by several threads at once, each thread may connect on its own instead. */
+
+struct PagingdClient;
+
+/*
+  Connect to the daemon listening on path (PAGINGD_SOCKET for NULL) and map the ring it hands over.
+  Return the client when success, NULL when failure.
+*/
+struct PagingdClient* pagingd_connect(const char* path);
+
+/*
+  Exit the processes of the client, unmap its ring and close the connection.
+*/
+void pagingd_disconnect(struct PagingdClient* client);
+
+/*
+  The same as proc_create_vm, proc_exit_vm, vm_read and vm_write on the daemon's kernel.
+  1. Accesses larger than a slot are split into slot-sized requests, pipelined over the ring:
+     the client fills (or drains) one slot while the daemon copies another. Bounds are checked up front,
+     but each piece is atomic to concurrent accesses only on its own.
+  2. A pid of another client is refused.
+  Return what the kernel.h call returns (-1 also when the daemon is gone).
+*/
+int pagingd_proc_create_vm(struct PagingdClient* client, int size);
+int pagingd_proc_exit_vm(struct PagingdClient* client, int pid);
+int pagingd_vm_read(struct PagingdClient* client, int pid, char* addr, int size, char* buf);
+int pagingd_vm_write(struct PagingdClient* client, int pid, char* addr, int size, char* buf);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel.h"
+
+long long pressure_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* This function will give the stall time (some or full) of the window seconds up to now in per cent. */
+static double stall_percent(struct Pressure* pressure, int full, int window, long long now_sec) {
+    long long stalled = 0;
+    for (int i = 0; i < window; ++i) {
+        int bucket = (int) ((now_sec - i) % PRESSURE_SECONDS);
+        if (pressure->bucket_sec[bucket] == now_sec - i) stalled += full ? pressure->full_ns[bucket] : pressure->some_ns[bucket];
+    }
+    return stalled * 100.0 / (window * 1000000000.0);
+}
+
+static void notify(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1) return;
+}
+
+/* This function will signal the subscribers whose threshold is crossed from below, and re-arm those back below it. */
+void pressure_check(struct Kernel* kernel, int stalled) {
+    struct Pressure* pressure = kernel->pressure;
+    long long now_sec = -1;
+    for (int i = 0; i < pressure->trigger_num; ++i) {
+        struct PressureTrigger* trigger = &pressure->triggers[i];
+        int above;
+        if (trigger->window == 0) above = kernel->free_frames < trigger->free_frames;
+        else {
+            if (now_sec == -1) now_sec = pressure_clock() / 1000000000LL;
+            // Stall percentages only move on a stall or as time goes by
+            if (!stalled && now_sec == trigger->checked_sec) continue;
+            trigger->checked_sec = now_sec;
+            above = stall_percent(pressure, trigger->full, trigger->window, now_sec) >= trigger->percent;
+        }
+        if (above && !trigger->fired) notify(trigger->fd);
+        trigger->fired = above;
+    }
+}
+
+/* This function will account a stall which started at start (pressure_clock) and is over now. */
+void pressure_record(struct Kernel* kernel, long long start, int full) {
+    struct Pressure* pressure = kernel->pressure;
+    long long now = pressure_clock(), ns = now - start, now_sec = now / 1000000000LL;
+    int bucket = (int) (now_sec % PRESSURE_SECONDS);
+    if (pressure->bucket_sec[bucket] != now_sec) {
+        pressure->bucket_sec[bucket] = now_sec;
+        pressure->some_ns[bucket] = pressure->full_ns[bucket] = 0;
+    }
+    pressure->some_ns[bucket] += ns;
+    pressure->some_total += ns;
+    if (full) {
+        pressure->full_ns[bucket] += ns;
+        pressure->full_total += ns;
+    }
+    if (pressure->trigger_num > 0) pressure_check(kernel, 1);
+}
+
+/* This function will fill the pressure metrics of a kernel in, returns 0 when succeeded, -1 when failed. */
+int pressure_get_stats(struct Kernel* kernel, struct PressureStats* stats) {
+    if (stats == NULL) return -1;
+
+    long long now_sec = pressure_clock() / 1000000000LL;
+    struct Pressure* pressure = kernel->pressure;
+    stats->some_avg10 = stall_percent(pressure, 0, 10, now_sec);
+    stats->some_avg60 = stall_percent(pressure, 0, 60, now_sec);
+    stats->some_avg300 = stall_percent(pressure, 0, 300, now_sec);
+    stats->full_avg10 = stall_percent(pressure, 1, 10, now_sec);
+    stats->full_avg60 = stall_percent(pressure, 1, 60, now_sec);
+    stats->full_avg300 = stall_percent(pressure, 1, 300, now_sec);
+    stats->some_total_ns = pressure->some_total;
+    stats->full_total_ns = pressure->full_total;
+    stats->free_frames = kernel->free_frames;
+    return 0;
+}
+
+/* This function will add a subscriber, signalled when the stall time over window seconds reaches percent,
+ * or, for a 0 window, when fewer than free_frames frames are left,
+ * returns its eventfd when succeeded, -1 when failed. */
+int pressure_subscribe(struct Kernel* kernel, int full, int window, double percent, int free_frames) {
+    if (window < 0 || window > PRESSURE_SECONDS || (window > 0 && (percent <= 0 || percent > 100))) return -1;
+    if (window == 0 && free_frames <= 0) return -1;
+
+    struct Pressure* pressure = kernel->pressure;
+    if (pressure->trigger_num == PRESSURE_MAX_TRIGGERS) return -1;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct PressureTrigger* trigger = &pressure->triggers[pressure->trigger_num++];
+    trigger->fd = fd;
+    trigger->full = full != 0;
+    trigger->window = window;
+    trigger->percent = percent;
+    trigger->free_frames = free_frames;
+    trigger->fired = 0;
+    trigger->checked_sec = -1;
+    // A subscriber joining under pressure hears about it right away
+    pressure_check(kernel, 1);
+    return fd;
+}
+
+/* This function will remove a subscriber and close its eventfd, returns 0 when succeeded, -1 when failed. */
+int pressure_unsubscribe(struct Kernel* kernel, int fd) {
+    struct Pressure* pressure = kernel->pressure;
+    for (int i = 0; i < pressure->trigger_num; ++i)
+        if (pressure->triggers[i].fd == fd) {
+            close(fd);
+            pressure->triggers[i] = pressure->triggers[--pressure->trigger_num];
+            return 0;
+        }
+    return -1;
+}
+
+/* This function will close the eventfds of all the subscribers left and free the pressure state. */
+void pressure_release(struct Pressure* pressure) {
+    for (int i = 0; i < pressure->trigger_num; ++i) close(pressure->triggers[i].fd);
+    free(pressure);
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ref_kernel.h"
+
+extern int KERNEL_SPACE_SIZE;
+extern int VIRTUAL_SPACE_SIZE;
+extern int PAGE_SIZE;
+extern int MAX_PROCESS_NUM;
+
+// The kernel managed memory content is set to 0 initially.
+struct RefKernel* ref_init_kernel() {
+    struct RefKernel* kernel = malloc(sizeof(struct RefKernel));
+    kernel->frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+    kernel->space = calloc(KERNEL_SPACE_SIZE, sizeof(char));
+    kernel->allocated_pages = 0;
+    kernel->lent_num = 0;
+    kernel->occupied_pages = calloc(kernel->frames, sizeof(char));
+    kernel->running = calloc(MAX_PROCESS_NUM, sizeof(char));
+    kernel->mm = calloc(MAX_PROCESS_NUM, sizeof(struct RefMMStruct));
+    return kernel;
+}
+
+void ref_destroy_kernel(struct RefKernel* kernel) {
+    for (int i = 0; i < MAX_PROCESS_NUM; ++i) free(kernel->mm[i].ptes);
+    free(kernel->mm);
+    free(kernel->running);
+    free(kernel->occupied_pages);
+    free(kernel->space);
+    free(kernel);
+}
+
+// Copy the free kernel space information to buf, in the format of get_kernel_free_space_info.
+void ref_get_kernel_free_space_info(struct RefKernel* kernel, char* buf) {
+    int i = sprintf(buf, "free space: ");
+    int idx = 0, frames = kernel->frames;
+    while (idx < frames) {
+        while (idx < frames && kernel->occupied_pages[idx] == 1) ++idx;
+        int last = idx;
+        while (idx < frames && kernel->occupied_pages[idx] == 0) ++idx;
+        i += sprintf(buf + i, idx < frames ? "(addr:%d, size:%d) -> " : "(addr:%d, size:%d)\n", last * PAGE_SIZE, (idx - last) * PAGE_SIZE);
+    }
+}
+
+/* This function will create a process with the user-specified virtual memory size,
+ * the mapping to physical memory is not built up yet (PFN = -1, present = 0),
+ * returns a >= 0 pid (index in MMStruct array) when succeeded, -1 when failed. */
+int ref_proc_create_vm(struct RefKernel* kernel, int size) {
+    if (0 >= size || size > VIRTUAL_SPACE_SIZE) return -1;
+
+    int no_of_pages_needed = (size - 1) / PAGE_SIZE + 1;
+    if (kernel->allocated_pages + kernel->lent_num + no_of_pages_needed > kernel->frames) return -1;
+
+    int pid = -1;
+    for (int i = 0; i < MAX_PROCESS_NUM; ++i)
+        if (!kernel->running[i]) {
+            pid = i;
+            break;
+        }
+    if (pid == -1) return -1;
+
+    kernel->allocated_pages += no_of_pages_needed;
+    kernel->running[pid] = 1;
+    kernel->mm[pid].size = size;
+    kernel->mm[pid].ptes = malloc(sizeof(struct RefPTE) * no_of_pages_needed);
+    for (int i = 0; i < no_of_pages_needed; ++i) {
+        kernel->mm[pid].ptes[i].PFN = -1;
+        kernel->mm[pid].ptes[i].present = 0;
+    }
+    return pid;
+}
+
+/* This function will copy [addr, addr + size) of a user-specified process from (write = 0) or to (write = 1) buf
+ * (vm_read and vm_write of the original in one),
+ * mapping every page not yet mapped first with first fit policy, returns 0 when succeeded, -1 when failed. */
+static int ref_vm_copy(struct RefKernel* kernel, int pid, char* addr, int size, char* buf, int write) {
+    // The original trusted the pid, the fuzzer does not
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (size <= 0) return -1;
+    if (0 > (long long) addr || (long long) addr >= kernel->mm[pid].size) return -1;
+    if ((long long) addr + size > kernel->mm[pid].size) return -1;
+
+    int start = (long long) addr / PAGE_SIZE, start_offset = (long long) addr % PAGE_SIZE;
+    int end = ((long long) addr + size - 1) / PAGE_SIZE;
+    for (int i = start, curr = 0; i <= end; ++i) {
+        struct RefPTE* pte = &kernel->mm[pid].ptes[i];
+        if (!pte->present) {
+            int pfn = -1;
+            for (int j = 0; j < kernel->frames; ++j)
+                if (!kernel->occupied_pages[j]) {
+                    kernel->occupied_pages[j] = 1;
+                    pfn = j;
+                    break;
+                }
+            if (pfn == -1) return -1;
+            pte->PFN = pfn;
+            pte->present = 1;
+        }
+
+        int offset = i == start ? start_offset : 0, len = PAGE_SIZE - offset;
+        if (len > size - curr) len = size - curr;
+        char* frame = kernel->space + PAGE_SIZE * pte->PFN + offset;
+        if (write) memcpy(frame, buf + curr, len);
+        else memcpy(buf + curr, frame, len);
+        curr += len;
+    }
+    return 0;
+}
+
+int ref_vm_read(struct RefKernel* kernel, int pid, char* addr, int size, char* buf) {
+    return ref_vm_copy(kernel, pid, addr, size, buf, 0);
+}
+
+int ref_vm_write(struct RefKernel* kernel, int pid, char* addr, int size, char* buf) {
+    return ref_vm_copy(kernel, pid, addr, size, buf, 1);
+}
+
+/* This function will destroy a user-specified process, returns 0 when succeeded, -1 when failed. */
+int ref_proc_exit_vm(struct RefKernel* kernel, int pid) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+
+    int no_of_pages_allocated = (kernel->mm[pid].size - 1) / PAGE_SIZE + 1;
+    for (int i = 0; i < no_of_pages_allocated; ++i)
+        if (kernel->mm[pid].ptes[i].present) kernel->occupied_pages[kernel->mm[pid].ptes[i].PFN] = 0;
+    kernel->mm[pid].size = 0;
+    kernel->allocated_pages -= no_of_pages_allocated;
+    free(kernel->mm[pid].ptes);
+    kernel->mm[pid].ptes = NULL;
+    kernel->running[pid] = 0;
+    return 0;
+}
+
+/* This function will set the first free frame aside as a frame buffer, out of the capacity left to the processes,
+ * returns its PFN when succeeded, -1 when failed. */
+int ref_alloc_frame_buffer(struct RefKernel* kernel) {
+    if (kernel->allocated_pages + kernel->lent_num + 1 > kernel->frames) return -1;
+    for (int j = 0; j < kernel->frames; ++j)
+        if (!kernel->occupied_pages[j]) {
+            kernel->occupied_pages[j] = 1;
+            ++kernel->lent_num;
+            return j;
+        }
+    return -1;
+}
+
+void ref_free_frame_buffer(struct RefKernel* kernel, int pfn) {
+    kernel->occupied_pages[pfn] = 0;
+    --kernel->lent_num;
+}
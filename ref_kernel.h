@@ -0,0 +1,45 @@
+#ifndef REF_KERNEL_H
+#define REF_KERNEL_H
+
+/* Reference model: a rewrite of the semantics of the original simple paging unit (first fit, no swap, no clones,
+ * one thread), for fuzz.c to check the optimized kernel against, not the original code itself:
+ * vm_read and vm_write share one copy loop, which takes the length of each page from what is left to copy
+ * (the original special-cased the first, middle and last pages), with the same bytes and first fit mappings,
+ * and a pid that is out of range or not running fails where the original trusted it.
+ * Frame buffers (kernel_alloc_frame_buffer) are the one addition: a frame set aside, first fit, out of the capacity.
+ * Its symbols are renamed so that both link into one binary, it reads the same KERNEL_SPACE_SIZE,
+ * VIRTUAL_SPACE_SIZE, PAGE_SIZE and MAX_PROCESS_NUM as the kernel, KERNEL_SPACE_SIZE only once, at ref_init_kernel:
+ * a kernel with swap is checked against a model with as many frames as the kernel has frames and swap slots.
+ * Do not optimize it: it is only useful as long as it stays obviously right. */
+
+struct RefPTE {
+    int PFN;
+    char present;
+};
+
+struct RefMMStruct {
+    int size;
+    struct RefPTE* ptes;
+};
+
+struct RefKernel {
+    int frames;
+    char* space;
+    int allocated_pages;
+    int lent_num;
+    char* occupied_pages;
+    char* running;
+    struct RefMMStruct* mm;
+};
+
+struct RefKernel* ref_init_kernel();
+void ref_destroy_kernel(struct RefKernel* kernel);
+void ref_get_kernel_free_space_info(struct RefKernel* kernel, char* buf);
+int ref_proc_create_vm(struct RefKernel* kernel, int size);
+int ref_vm_read(struct RefKernel* kernel, int pid, char* addr, int size, char* buf);
+int ref_vm_write(struct RefKernel* kernel, int pid, char* addr, int size, char* buf);
+int ref_proc_exit_vm(struct RefKernel* kernel, int pid);
+int ref_alloc_frame_buffer(struct RefKernel* kernel);
+void ref_free_frame_buffer(struct RefKernel* kernel, int pfn);
+
+#endif
@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "kernel.h"
+
+/* This function will add a swap file with room for slots pages to a kernel,
+ * returns the device index when succeeded, -1 when failed. */
+int swap_add(struct Kernel* kernel, const char* path, int slots, int priority) {
+    if (slots <= 0 || slots > SWAP_SLOT(-1) + 1) return -1;
+    if (kernel->swap != NULL && kernel->swap->num == SWAP_MAX_DEVICES) return -1;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return -1;
+    if (ftruncate(fd, (off_t) slots * PAGE_SIZE) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (kernel->swap == NULL) {
+        kernel->swap = calloc(1, sizeof(struct SwapArea));
+        kernel->swap->refs = 1;
+        kernel->swap->reserved = swap_reserved(kernel);
+    }
+    struct SwapArea* area = kernel->swap;
+    area->devices = realloc(area->devices, sizeof(struct SwapDevice) * (area->num + 1));
+
+    struct SwapDevice* dev = &area->devices[area->num];
+    memset(dev, 0, sizeof(struct SwapDevice));
+    dev->fd = fd;
+    dev->priority = priority;
+    dev->slots = slots;
+    dev->slot_refs = calloc(slots, sizeof(int));
+    dev->stats.slots = slots;
+
+    area->total_slots += slots;
+    return area->num++;
+}
+
+/* This function will copy the statistics of a swap device,
+ * returns 0 when succeeded, -1 when failed. */
+int swap_get_stats(struct Kernel* kernel, int dev, struct SwapStats* stats) {
+    if (kernel->swap == NULL || 0 > dev || dev >= kernel->swap->num) return -1;
+
+    *stats = kernel->swap->devices[dev].stats;
+    stats->used_slots = kernel->swap->devices[dev].used_slots;
+    return 0;
+}
+
+/* This function will tell how many slots of its swap area a kernel counts on:
+ * those for its reserved pages (and lent frames) beyond its frames. */
+int swap_reserved(struct Kernel* kernel) {
+    return max(0, kernel->allocated_pages + kernel->lent_num - KERNEL_SPACE_SIZE / PAGE_SIZE);
+}
+
+int swap_used_slots(struct SwapArea* area) {
+    int used = 0;
+    for (int i = 0; i < area->num; ++i) used += area->devices[i].used_slots;
+    return used;
+}
+
+/* This function will take a free slot, from the devices of the highest priority that still have one,
+ * striping SWAP_CLUSTER slots at a time across devices of equal priority,
+ * returns the swap entry (with one reference) when succeeded, -1 when failed (swap is full). */
+int swap_alloc_slot(struct SwapArea* area) {
+    int best = -1;
+    for (int i = 0; i < area->num; ++i)
+        if (area->devices[i].used_slots < area->devices[i].slots
+            && (best == -1 || area->devices[i].priority > area->devices[best].priority))
+            best = i;
+    if (best == -1) return -1;
+
+    int priority = area->devices[best].priority;
+    struct SwapDevice* cursor = &area->devices[area->cursor];
+    if (area->cluster_left == 0 || cursor->priority != priority || cursor->used_slots == cursor->slots) {
+        // Move on to the next device of the same priority that has a free slot
+        for (int i = 1; i <= area->num; ++i) {
+            int d = (area->cursor + i) % area->num;
+            if (area->devices[d].priority == priority && area->devices[d].used_slots < area->devices[d].slots) {
+                area->cursor = d;
+                break;
+            }
+        }
+        area->cluster_left = SWAP_CLUSTER;
+    }
+
+    struct SwapDevice* dev = &area->devices[area->cursor];
+    int slot = dev->next_slot;
+    while (dev->slot_refs[slot]) slot = (slot + 1) % dev->slots;
+    dev->slot_refs[slot] = 1;
+    dev->next_slot = (slot + 1) % dev->slots;
+    ++dev->used_slots;
+    --area->cluster_left;
+    return SWAP_ENTRY(area->cursor, slot);
+}
+
+void swap_slot_get(struct SwapArea* area, int entry) {
+    ++area->devices[SWAP_DEV(entry)].slot_refs[SWAP_SLOT(entry)];
+}
+
+void swap_slot_put(struct SwapArea* area, int entry) {
+    struct SwapDevice* dev = &area->devices[SWAP_DEV(entry)];
+    if (--dev->slot_refs[SWAP_SLOT(entry)] == 0) --dev->used_slots;
+}
+
+/* This function will write a page to its swap slot,
+ * returns 0 when succeeded, -1 when failed. */
+int swap_write_page(struct SwapArea* area, int entry, const char* page) {
+    struct SwapDevice* dev = &area->devices[SWAP_DEV(entry)];
+    long long start = pressure_clock();
+    ssize_t n = pwrite(dev->fd, page, PAGE_SIZE, (off_t) SWAP_SLOT(entry) * PAGE_SIZE);
+    dev->stats.io_ns += pressure_clock() - start;
+    if (n != PAGE_SIZE) return -1;
+
+    ++dev->stats.pages_out;
+    return 0;
+}
+
+/* This function will read a page back from its swap slot,
+ * returns 0 when succeeded, -1 when failed. */
+int swap_read_page(struct SwapArea* area, int entry, char* page) {
+    struct SwapDevice* dev = &area->devices[SWAP_DEV(entry)];
+    long long start = pressure_clock();
+    ssize_t n = pread(dev->fd, page, PAGE_SIZE, (off_t) SWAP_SLOT(entry) * PAGE_SIZE);
+    dev->stats.io_ns += pressure_clock() - start;
+    if (n != PAGE_SIZE) return -1;
+
+    ++dev->stats.pages_in;
+    return 0;
+}
+
+/* This function will drop a kernel's reference on a swap area, closing its devices with the last one. */
+void swap_release_area(struct SwapArea* area) {
+    if (area == NULL || --area->refs > 0) return;
+
+    for (int i = 0; i < area->num; ++i) {
+        close(area->devices[i].fd);
+        free(area->devices[i].slot_refs);
+    }
+    free(area->devices);
+    free(area);
+}
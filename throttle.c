@@ -0,0 +1,110 @@
+#include <time.h>
+
+#include "kernel.h"
+
+/* This function will add the tokens earned since the last refill, up to one second worth (the burst). */
+static void refill(struct TokenBucket* bucket, long long now) {
+    if (bucket->rate == 0) return;
+    bucket->tokens += bucket->rate * (now - bucket->last_ns) / 1e9;
+    if (bucket->tokens > bucket->rate) bucket->tokens = bucket->rate;
+    bucket->last_ns = now;
+}
+
+/* This function will tell how long the debt of a bucket takes to pay back, in ns. */
+static long long debt_ns(struct TokenBucket* bucket) {
+    return bucket->rate == 0 || bucket->tokens >= 0 ? 0 : (long long) (-bucket->tokens / bucket->rate * 1e9);
+}
+
+/* This function will set the limits of a user-specified process, 0 for no limit (both 0 -> not throttled),
+ * returns 0 when succeeded, -1 when failed. */
+int proc_set_throttle(struct Kernel* kernel, int pid, long long bytes_per_sec, int faults_per_sec) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid]) return -1;
+    if (bytes_per_sec < 0 || faults_per_sec < 0) return -1;
+
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (bytes_per_sec == 0 && faults_per_sec == 0) {
+        throttle_release(throttle);
+        kernel->mm[pid].throttle = NULL;
+        return 0;
+    }
+    if (throttle == NULL) {
+        throttle = calloc(1, sizeof(struct Throttle));
+        pthread_mutex_init(&throttle->mutex, NULL);
+        kernel->mm[pid].throttle = throttle;
+    }
+
+    // Both buckets start full
+    long long now = pressure_clock();
+    pthread_mutex_lock(&throttle->mutex);
+    throttle->bytes = (struct TokenBucket) {bytes_per_sec, bytes_per_sec, now};
+    throttle->faults = (struct TokenBucket) {faults_per_sec, faults_per_sec, now};
+    throttle->stats.bytes_per_sec = bytes_per_sec;
+    throttle->stats.faults_per_sec = faults_per_sec;
+    pthread_mutex_unlock(&throttle->mutex);
+    return 0;
+}
+
+/* This function will fill the throttling stats of a user-specified process in (all 0 when not throttled),
+ * returns 0 when succeeded, -1 when failed. */
+int proc_get_throttle_stats(struct Kernel* kernel, int pid, struct ThrottleStats* stats) {
+    if (0 > pid || pid >= MAX_PROCESS_NUM || !kernel->running[pid] || stats == NULL) return -1;
+
+    struct Throttle* throttle = kernel->mm[pid].throttle;
+    if (throttle == NULL) {
+        memset(stats, 0, sizeof(struct ThrottleStats));
+        return 0;
+    }
+    pthread_mutex_lock(&throttle->mutex);
+    *stats = throttle->stats;
+    pthread_mutex_unlock(&throttle->mutex);
+    return 0;
+}
+
+/* This function will take bytes and faults from the buckets of a throttle, running into debt if needed,
+ * returns how long the caller has to wait for the debt to be paid back, in ns. */
+long long throttle_charge(struct Throttle* throttle, long long bytes, int faults) {
+    long long now = pressure_clock();
+    pthread_mutex_lock(&throttle->mutex);
+    refill(&throttle->bytes, now);
+    refill(&throttle->faults, now);
+    if (throttle->bytes.rate > 0) throttle->bytes.tokens -= bytes;
+    if (throttle->faults.rate > 0) throttle->faults.tokens -= faults;
+    throttle->stats.bytes += bytes;
+    throttle->stats.faults += faults;
+    long long wait = max(debt_ns(&throttle->bytes), debt_ns(&throttle->faults));
+    pthread_mutex_unlock(&throttle->mutex);
+    return wait;
+}
+
+/* This function will sleep for wait ns (from throttle_charge) and account it. */
+void throttle_wait(struct Throttle* throttle, long long wait) {
+    if (wait <= 0) return;
+
+    struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+    while (nanosleep(&ts, &ts) == -1);
+    pthread_mutex_lock(&throttle->mutex);
+    ++throttle->stats.throttled_calls;
+    throttle->stats.throttled_ns += wait;
+    pthread_mutex_unlock(&throttle->mutex);
+}
+
+/* This function will copy the limits of a throttle into a new one with full buckets and empty stats,
+ * returns NULL for a NULL throttle. */
+struct Throttle* throttle_copy(struct Throttle* throttle) {
+    if (throttle == NULL) return NULL;
+
+    struct Throttle* copy = calloc(1, sizeof(struct Throttle));
+    pthread_mutex_init(&copy->mutex, NULL);
+    long long now = pressure_clock();
+    copy->bytes = (struct TokenBucket) {throttle->bytes.rate, throttle->bytes.rate, now};
+    copy->faults = (struct TokenBucket) {throttle->faults.rate, throttle->faults.rate, now};
+    copy->stats.bytes_per_sec = throttle->stats.bytes_per_sec;
+    copy->stats.faults_per_sec = throttle->stats.faults_per_sec;
+    return copy;
+}
+
+void throttle_release(struct Throttle* throttle) {
+    if (throttle == NULL) return;
+    pthread_mutex_destroy(&throttle->mutex);
+    free(throttle);
+}
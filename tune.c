@@ -0,0 +1,206 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel.h"
+
+/* Auto-tuner: replays a trace against every candidate configuration and recommends the best one.
+ *
+ * Trace format, one operation per line (<id> is the trace's own process number, in creation order):
+ *   c <size>                 proc_create_vm
+ *   r <id> <addr> <size>     vm_read
+ *   w <id> <addr> <size>     vm_write
+ *   e <id>                   proc_exit_vm
+ *
+ * Usage: ./tune <trace> [-k KERNEL_SPACE_SIZE] [-v VIRTUAL_SPACE_SIZE] [-m MAX_PROCESS_NUM] [-s swap slots] [-n repeats] */
+
+struct Op {
+    char type;
+    int id, addr, size;
+};
+
+struct Result {
+    int page_size, fault_around, alloc_policy, replacement_policy;
+    double seconds;          // Best time of all the repeats.
+    int failed;              // Operations that returned -1.
+    long long metadata;      // Bytes of page tables and frame bookkeeping at the peak.
+    double fragmentation;    // 1 - largest free run / free frames, averaged over the samples.
+    int peak_frames;         // The most frames in use at once.
+};
+
+static int PAGE_SIZES[] = {16, 32, 64, 128, 256, 512, 1024, 4096};
+static int FAULT_AROUNDS[] = {0, 1, 4, 16};
+
+static struct Op* load_trace(const char* path, int* num) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+
+    int cap = 1024;
+    struct Op* ops = malloc(sizeof(struct Op) * cap);
+    char line[256];
+    *num = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct Op op = {0};
+        int n;
+        if (sscanf(line, " %c%n", &op.type, &n) != 1 || op.type == '#') continue;
+        if ((op.type == 'c' && sscanf(line + n, "%d", &op.size) == 1)
+            || ((op.type == 'r' || op.type == 'w') && sscanf(line + n, "%d %d %d", &op.id, &op.addr, &op.size) == 3)
+            || (op.type == 'e' && sscanf(line + n, "%d", &op.id) == 1)) {
+            if (*num == cap) ops = realloc(ops, sizeof(struct Op) * (cap *= 2));
+            ops[(*num)++] = op;
+        }
+        else fprintf(stderr, "skipping malformed trace line: %s", line);
+    }
+    fclose(file);
+    return ops;
+}
+
+static double fragmentation(struct Kernel* kernel) {
+    int frames = KERNEL_SPACE_SIZE / PAGE_SIZE, free_frames = 0, run = 0, largest = 0;
+    for (int j = 0; j < frames; ++j) {
+        if (kernel->occupied_pages[j]) run = 0;
+        else {
+            ++free_frames;
+            if (++run > largest) largest = run;
+        }
+    }
+    return free_frames ? 1.0 - (double) largest / free_frames : 0.0;
+}
+
+static long long metadata(struct Kernel* kernel) {
+    long long bytes = sizeof(struct Kernel) + KERNEL_SPACE_SIZE / PAGE_SIZE + MAX_PROCESS_NUM * (sizeof(struct MMStruct) + 1);
+    for (int pid = 0; pid < MAX_PROCESS_NUM; ++pid)
+        if (kernel->running[pid])
+            bytes += sizeof(struct PageTable) + sizeof(struct PTE) * ((kernel->mm[pid].size - 1) / PAGE_SIZE + 1);
+    return bytes;
+}
+
+static void replay(struct Op* ops, int num, int swap_slots, char* buf, struct Result* result, int sample) {
+    struct Kernel* kernel = init_kernel();
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/tune-swap-%d", (int) getpid());
+    if (swap_slots > 0) swap_add(kernel, path, swap_slots, 0);
+
+    int cap = 16, created = 0;
+    int* pids = malloc(sizeof(int) * cap);
+    int failed = 0, samples = 0, peak = 0;
+    long long peak_metadata = 0;
+    double fragmented = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num; ++i) {
+        struct Op* op = &ops[i];
+        int ret = -1;
+        if (op->type == 'c') {
+            if (created == cap) pids = realloc(pids, sizeof(int) * (cap *= 2));
+            ret = pids[created++] = proc_create_vm(kernel, op->size);
+        }
+        else if (0 <= op->id && op->id < created && pids[op->id] != -1) {
+            if (op->type == 'r') ret = vm_read(kernel, pids[op->id], (char*) (long long) op->addr, op->size, buf);
+            else if (op->type == 'w') ret = vm_write(kernel, pids[op->id], (char*) (long long) op->addr, op->size, buf);
+            else {
+                ret = proc_exit_vm(kernel, pids[op->id]);
+                pids[op->id] = -1;
+            }
+        }
+        failed += ret == -1;
+
+        // Only the sampling run inspects the layout, its time is not used
+        if (sample && i % 64 == 0) {
+            int used = 0;
+            for (int j = 0; j < KERNEL_SPACE_SIZE / PAGE_SIZE; ++j) used += kernel->occupied_pages[j];
+            if (used > peak) peak = used;
+            long long bytes = metadata(kernel);
+            if (bytes > peak_metadata) peak_metadata = bytes;
+            fragmented += fragmentation(kernel);
+            ++samples;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (sample) {
+        result->failed = failed;
+        result->peak_frames = peak;
+        result->metadata = peak_metadata;
+        result->fragmentation = samples ? fragmented / samples : 0;
+    }
+    else if (result->seconds == 0 || seconds < result->seconds) result->seconds = seconds;
+
+    free(pids);
+    destroy_kernel(kernel);
+    if (swap_slots > 0) unlink(path);
+}
+
+// Fewer failures first, then faster, then less metadata, then less fragmented.
+static int better(struct Result* a, struct Result* b) {
+    if (a->failed != b->failed) return a->failed < b->failed;
+    if (a->seconds < b->seconds * 0.95) return 1;
+    if (b->seconds < a->seconds * 0.95) return 0;
+    if (a->metadata != b->metadata) return a->metadata < b->metadata;
+    return a->fragmentation < b->fragmentation;
+}
+
+int main(int argc, char** argv) {
+    int swap_slots = 0, repeats = 3, opt;
+    while ((opt = getopt(argc, argv, "k:v:m:s:n:")) != -1) {
+        if (opt == 'k') KERNEL_SPACE_SIZE = atoi(optarg);
+        else if (opt == 'v') VIRTUAL_SPACE_SIZE = atoi(optarg);
+        else if (opt == 'm') MAX_PROCESS_NUM = atoi(optarg);
+        else if (opt == 's') swap_slots = atoi(optarg);
+        else if (opt == 'n') repeats = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s <trace> [-k kernel space] [-v virtual space] [-m processes] [-s swap slots] [-n repeats]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s <trace> [-k kernel space] [-v virtual space] [-m processes] [-s swap slots] [-n repeats]\n", argv[0]);
+        return 1;
+    }
+
+    int num;
+    struct Op* ops = load_trace(argv[optind], &num);
+    if (ops == NULL) {
+        fprintf(stderr, "cannot read trace %s\n", argv[optind]);
+        return 1;
+    }
+    int max_size = 1;
+    for (int i = 0; i < num; ++i) max_size = ops[i].size > max_size ? ops[i].size : max_size;
+    char* buf = calloc(max_size, sizeof(char));
+
+    printf("%9s %12s %6s %11s %10s %7s %12s %10s %6s\n",
+           "page_size", "fault_around", "alloc", "replacement", "time(ms)", "failed", "metadata(B)", "frag", "peak");
+    struct Result best = {0};
+    int found = 0;
+    for (int p = 0; p < (int) (sizeof(PAGE_SIZES) / sizeof(int)); ++p) {
+        if (PAGE_SIZES[p] > KERNEL_SPACE_SIZE) continue;
+        for (int f = 0; f < (int) (sizeof(FAULT_AROUNDS) / sizeof(int)); ++f)
+            for (int a = ALLOC_FIRST_FIT; a <= ALLOC_NEXT_FIT; ++a)
+                // The replacement policy only matters with swap
+                for (int r = REPLACE_CLOCK; r <= (swap_slots > 0 ? REPLACE_FIFO : REPLACE_CLOCK); ++r) {
+                    PAGE_SIZE = PAGE_SIZES[p];
+                    FAULT_AROUND_PAGES = FAULT_AROUNDS[f];
+                    ALLOC_POLICY = a;
+                    REPLACEMENT_POLICY = r;
+
+                    struct Result result = {.page_size = PAGE_SIZE, .fault_around = FAULT_AROUND_PAGES, .alloc_policy = a, .replacement_policy = r};
+                    replay(ops, num, swap_slots, buf, &result, 1);
+                    for (int i = 0; i < repeats; ++i) replay(ops, num, swap_slots, buf, &result, 0);
+
+                    printf("%9d %12d %6s %11s %10.3f %7d %12lld %10.3f %6d\n", result.page_size, result.fault_around,
+                           a == ALLOC_FIRST_FIT ? "first" : "next", r == REPLACE_CLOCK ? "clock" : "fifo",
+                           result.seconds * 1e3, result.failed, result.metadata, result.fragmentation, result.peak_frames);
+                    if (!found || better(&result, &best)) best = result;
+                    found = 1;
+                }
+    }
+
+    if (found)
+        printf("\nrecommended: PAGE_SIZE=%d FAULT_AROUND_PAGES=%d ALLOC_POLICY=%s REPLACEMENT_POLICY=%s\n",
+               best.page_size, best.fault_around, best.alloc_policy == ALLOC_FIRST_FIT ? "ALLOC_FIRST_FIT" : "ALLOC_NEXT_FIT",
+               best.replacement_policy == REPLACE_CLOCK ? "REPLACE_CLOCK" : "REPLACE_FIFO");
+    free(buf);
+    free(ops);
+    return 0;
+}
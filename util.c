@@ -1,44 +1,232 @@
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "kernel.h"
 
 int KERNEL_SPACE_SIZE = 8192;
 int VIRTUAL_SPACE_SIZE = 512;
 int PAGE_SIZE = 32;
 int MAX_PROCESS_NUM = 8;
+int PARALLEL_COPY_THRESHOLD = 0;
+int PARALLEL_COPY_THREADS = 1;
+int CHECKPOINT_THREADS = 1;
+int ALLOC_POLICY = ALLOC_FIRST_FIT;
+int REPLACEMENT_POLICY = REPLACE_CLOCK;
+int FAULT_AROUND_PAGES = 0;
+int FREE_PAGE_REPORTING_BATCH = 0;
+int ZERO_PAGE_DETECTION = 0;
+int PREFETCH_PAGES = 0;
+int HOT_FRAMES = 0;
+
+// The kernel managed memory is mapped straight from the OS (page aligned and zero-filled on first touch),
+// so that the host memory behind free frames can be handed back to it.
+static char* map_space() {
+  char* space = mmap(NULL, KERNEL_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return space == MAP_FAILED ? NULL : space;
+}
 
 // The kernel managed memory content is set to 0 initiallly.
 struct Kernel* init_kernel() {
   struct Kernel* kernel = (struct Kernel*)malloc(sizeof(struct Kernel));
 
-  kernel->space = (char*)malloc(sizeof(char) * KERNEL_SPACE_SIZE);
+  kernel->space = map_space();
   kernel->allocated_pages = 0;
   kernel->occupied_pages = (char*)malloc(sizeof(char) * KERNEL_SPACE_SIZE / PAGE_SIZE);
   kernel->running = (char*)malloc(sizeof(char) * MAX_PROCESS_NUM);
   kernel->mm = (struct MMStruct*)malloc(sizeof(struct MMStruct) * MAX_PROCESS_NUM);
 
-  for (int i = 0; i < MAX_PROCESS_NUM; i ++)
+  kernel->cow = NULL;
+  kernel->base = NULL;
+  kernel->map_epoch = 0;
+  kernel->foreign_frames = NULL;
+  kernel->foreign_num = 0;
+  kernel->foreign_free = NULL;
+  kernel->foreign_free_num = 0;
+  kernel->swap = NULL;
+  kernel->clock_pid = kernel->clock_page = 0;
+  kernel->next_fit = 0;
+  kernel->hot_cap = HOT_FRAMES;
+  kernel->hot = (int*)malloc(sizeof(int) * (HOT_FRAMES + 1));
+  kernel->hot_num = kernel->hot_top = 0;
+  kernel->copy_page = select_copy_page();
+  kernel->lent = (char*)calloc(KERNEL_SPACE_SIZE / PAGE_SIZE, sizeof(char));
+  kernel->lent_num = 0;
+  kernel->free_seen = (char*)calloc(KERNEL_SPACE_SIZE / PAGE_SIZE, sizeof(char));
+  kernel->reported = (char*)calloc(KERNEL_SPACE_SIZE / PAGE_SIZE, sizeof(char));
+  kernel->freed_since_report = 0;
+  kernel->reclaim_pid = kernel->reclaim_page = 0;
+  kernel->cold_reclaimed = kernel->cold_refaults = 0;
+  kernel->free_frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+  kernel->pressure = (struct Pressure*)calloc(1, sizeof(struct Pressure));
+  pthread_rwlock_init(&kernel->lock, NULL);
+  kernel->range_locks = (struct RangeLock*)calloc(MAX_PROCESS_NUM, sizeof(struct RangeLock));
+
+  for (int i = 0; i < MAX_PROCESS_NUM; i ++) {
+    pthread_mutex_init(&kernel->range_locks[i].mutex, NULL);
+    pthread_cond_init(&kernel->range_locks[i].released, NULL);
     kernel->mm[i].page_table = NULL;
+    kernel->mm[i].generation = 0;
+    kernel->mm[i].rt_pool = NULL;
+    kernel->mm[i].rt_pool_num = 0;
+    kernel->mm[i].hibernate_fd = -1;
+    kernel->mm[i].reclaim_age = 0;
+    kernel->mm[i].throttle = NULL;
+    kernel->mm[i].prefetcher = NULL;
+    kernel->mm[i].heap_spans = NULL;
+  }
 
-  memset(kernel->space, 0, sizeof(char) * KERNEL_SPACE_SIZE);
   memset(kernel->occupied_pages, 0, sizeof(char) * KERNEL_SPACE_SIZE / PAGE_SIZE);
   memset(kernel->running, 0, sizeof(char) * MAX_PROCESS_NUM);
 
   return kernel;
 }
 
+static void release_frame_store(struct FrameStore* store) {
+  while (store != NULL && -- store->refs == 0) {
+    struct FrameStore* base = store->base;
+    munmap(store->space, KERNEL_SPACE_SIZE);
+    free(store->cow);
+    free(store);
+    store = base;
+  }
+}
+
 void destroy_kernel(struct Kernel* kernel) {
-  free(kernel->space);
+  munmap(kernel->space, KERNEL_SPACE_SIZE);
   free(kernel->occupied_pages);
   free(kernel->running);
   for (int i = 0; i < MAX_PROCESS_NUM; i ++) {
-    if (kernel->mm[i].page_table != NULL) {
+    if (kernel->mm[i].page_table != NULL && -- kernel->mm[i].page_table->refs == 0) {
+      for (int j = 0; j < (kernel->mm[i].size + PAGE_SIZE - 1) / PAGE_SIZE; j ++)
+        if (kernel->mm[i].page_table->ptes[j].swapped)
+          swap_slot_put(kernel->swap, kernel->mm[i].page_table->ptes[j].PFN);
       free(kernel->mm[i].page_table->ptes);
       free(kernel->mm[i].page_table);
     }
+    free(kernel->mm[i].rt_pool);
+    throttle_release(kernel->mm[i].throttle);
+    free(kernel->mm[i].prefetcher);
+    free(kernel->mm[i].heap_spans);
+    if (kernel->mm[i].hibernate_fd != -1)
+      close(kernel->mm[i].hibernate_fd);
   }
   free(kernel->mm);
+  free(kernel->cow);
+  free(kernel->free_seen);
+  free(kernel->hot);
+  free(kernel->lent);
+  free(kernel->reported);
+  release_frame_store(kernel->base);
+  free(kernel->foreign_frames);
+  free(kernel->foreign_free);
+  if (kernel->swap != NULL)
+    kernel->swap->reserved -= swap_reserved(kernel);
+  swap_release_area(kernel->swap);
+  pressure_release(kernel->pressure);
+  pthread_rwlock_destroy(&kernel->lock);
+  for (int i = 0; i < MAX_PROCESS_NUM; i ++) {
+    pthread_mutex_destroy(&kernel->range_locks[i].mutex);
+    pthread_cond_destroy(&kernel->range_locks[i].released);
+    free(kernel->range_locks[i].held);
+  }
+  free(kernel->range_locks);
   free(kernel);
 }
 
+// The frames and page tables are shared copy-on-write, see kernel.h.
+struct Kernel* kernel_clone(struct Kernel* kernel) {
+  int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+  if (kernel->lent_num > 0)
+    return NULL;
+  // The clone counts on as many shared swap slots as the original does
+  if (kernel->swap != NULL && kernel->swap->reserved + swap_reserved(kernel) > kernel->swap->total_slots)
+    return NULL;
+
+  // Freeze the current frames, both kernels start over with an empty (lazily zeroed) space.
+  struct FrameStore* store = (struct FrameStore*)malloc(sizeof(struct FrameStore));
+  store->space = kernel->space;
+  store->cow = kernel->cow;
+  store->base = kernel->base;
+  store->refs = 2;
+
+  kernel->space = map_space();
+  memset(kernel->free_seen, 0, sizeof(char) * frames);
+  kernel->hot_num = 0;
+  memset(kernel->reported, 0, sizeof(char) * frames);
+  kernel->cow = (char*)malloc(sizeof(char) * frames);
+  memcpy(kernel->cow, kernel->occupied_pages, sizeof(char) * frames);
+  kernel->base = store;
+
+  struct Kernel* clone = (struct Kernel*)malloc(sizeof(struct Kernel));
+  clone->space = map_space();
+  clone->allocated_pages = kernel->allocated_pages;
+  clone->occupied_pages = (char*)malloc(sizeof(char) * frames);
+  memcpy(clone->occupied_pages, kernel->occupied_pages, sizeof(char) * frames);
+  clone->running = (char*)malloc(sizeof(char) * MAX_PROCESS_NUM);
+  memcpy(clone->running, kernel->running, sizeof(char) * MAX_PROCESS_NUM);
+  clone->mm = (struct MMStruct*)malloc(sizeof(struct MMStruct) * MAX_PROCESS_NUM);
+  memcpy(clone->mm, kernel->mm, sizeof(struct MMStruct) * MAX_PROCESS_NUM);
+  clone->cow = (char*)malloc(sizeof(char) * frames);
+  memcpy(clone->cow, kernel->cow, sizeof(char) * frames);
+  clone->base = store;
+  clone->map_epoch = 0;
+  clone->foreign_num = kernel->foreign_num;
+  clone->foreign_frames = (char**)malloc(sizeof(char*) * kernel->foreign_num);
+  clone->foreign_free = (int*)malloc(sizeof(int) * kernel->foreign_num);
+  clone->foreign_free_num = kernel->foreign_free_num;
+  // Both are NULL until host memory is first attached
+  if (kernel->foreign_num > 0) {
+    memcpy(clone->foreign_frames, kernel->foreign_frames, sizeof(char*) * kernel->foreign_num);
+    memcpy(clone->foreign_free, kernel->foreign_free, sizeof(int) * kernel->foreign_free_num);
+  }
+  clone->swap = kernel->swap;
+  clone->lent_num = 0;
+  if (clone->swap != NULL) {
+    ++ clone->swap->refs;
+    clone->swap->reserved += swap_reserved(clone);
+  }
+  clone->clock_pid = clone->clock_page = 0;
+  clone->next_fit = kernel->next_fit;
+  // Neither kernel's freed frames are warm any more, both start over with an empty space
+  clone->hot_cap = kernel->hot_cap;
+  clone->hot = (int*)malloc(sizeof(int) * (kernel->hot_cap + 1));
+  clone->hot_num = clone->hot_top = 0;
+  clone->copy_page = kernel->copy_page;
+  clone->lent = (char*)calloc(frames, sizeof(char));
+  clone->free_seen = (char*)calloc(frames, sizeof(char));
+  clone->reported = (char*)calloc(frames, sizeof(char));
+  clone->freed_since_report = 0;
+  clone->reclaim_pid = clone->reclaim_page = 0;
+  clone->cold_reclaimed = clone->cold_refaults = 0;
+  clone->free_frames = kernel->free_frames;
+  clone->pressure = (struct Pressure*)calloc(1, sizeof(struct Pressure));
+  pthread_rwlock_init(&clone->lock, NULL);
+  clone->range_locks = (struct RangeLock*)calloc(MAX_PROCESS_NUM, sizeof(struct RangeLock));
+
+  for (int i = 0; i < MAX_PROCESS_NUM; i ++) {
+    pthread_mutex_init(&clone->range_locks[i].mutex, NULL);
+    pthread_cond_init(&clone->range_locks[i].released, NULL);
+    if (clone->mm[i].page_table != NULL)
+      ++ clone->mm[i].page_table->refs;
+    if (clone->mm[i].rt_pool != NULL) {
+      int no_of_pages = (clone->mm[i].size - 1) / PAGE_SIZE + 1;
+      clone->mm[i].rt_pool = (int*)malloc(sizeof(int) * no_of_pages);
+      memcpy(clone->mm[i].rt_pool, kernel->mm[i].rt_pool, sizeof(int) * clone->mm[i].rt_pool_num);
+    }
+    if (clone->mm[i].hibernate_fd != -1)
+      clone->mm[i].hibernate_fd = dup(kernel->mm[i].hibernate_fd);
+    clone->mm[i].throttle = throttle_copy(kernel->mm[i].throttle);
+    clone->mm[i].prefetcher = NULL;
+    if (clone->mm[i].heap_spans != NULL) {
+      int no_of_pages = (clone->mm[i].size - 1) / PAGE_SIZE + 1;
+      clone->mm[i].heap_spans = (int*)malloc(sizeof(int) * no_of_pages);
+      memcpy(clone->mm[i].heap_spans, kernel->mm[i].heap_spans, sizeof(int) * no_of_pages);
+    }
+  }
+
+  return clone;
+}
+
 // Print the free kernel space.
 void print_kernel_free_space(struct Kernel* kernel) {
   int idx = 0;
@@ -88,11 +276,20 @@ void print_memory_mappings(struct Kernel * kernel, int pid) {
   if (kernel->running[pid] == 0) {
     printf("The process is not running\n");
   }
+  else if (kernel->mm[pid].hibernate_fd != -1) {
+    printf("The process is hibernated\n");
+  }
   else {
     printf("Memory mappings of process %d\n", pid);
     for (int i = 0; i < (kernel->mm[pid].size + PAGE_SIZE - 1) / PAGE_SIZE; i++) {
-      if (kernel->mm[pid].page_table->ptes[i].present == 0)
+      if (kernel->mm[pid].page_table->ptes[i].swapped)
+        printf("virtual page %d: Swapped out\n", i);
+      else if (kernel->mm[pid].page_table->ptes[i].zero)
+        printf("virtual page %d: Zero page\n", i);
+      else if (kernel->mm[pid].page_table->ptes[i].present == 0)
         printf("virtual page %d: Not present\n", i);
+      else if (kernel->mm[pid].page_table->ptes[i].foreign)
+        printf("virtual page %d -> host memory\n", i);
       else
         printf("virtual page %d -> physical page %d\n", i, kernel->mm[pid].page_table->ptes[i].PFN);
     }